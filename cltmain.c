@@ -59,6 +59,7 @@
 #include <arpa/inet.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
 #include "auth.h"
@@ -74,7 +75,11 @@
 #include <stricmp.h>
 
 
-#define MAX_DATA_SIZE   (MSG_MAX_PAY_SIZE-24)
+/* Leave room for the OFFERID and TTL attributes, and the DATA header. */
+#define MAX_DATA_SIZE   (MSG_MAX_PAY_SIZE-40)
+
+/* Size of the receive buffer, filled by a single read. */
+#define RX_BUF_SIZE     (256 * 1024)
 
 
 enum CLT_STATE {
@@ -279,6 +284,8 @@ static int init_config( int argc, char *argv[] )
 
 #define PFX_TLST    "TLST"  // transfer list item
 #define PFX_PLST    "PLST"  // peer list item
+#define PFX_PADD    "PADD"  // peer appeared
+#define PFX_PDEL    "PDEL"  // peer left
 #define PFX_COUT    "COUT"  // external command output
 #define PFX_WDIR    "WDIR"  // current directory info
 
@@ -356,12 +363,15 @@ static int pcmd_cb( const char *s )
  *
  */
 
+/* Server socket, as seen by enqueue_msg() for eager writes. */
+static int sendfd = -1;
+
 static int disconnect_srv( int *pfd )
 {
     if ( 0 > *pfd )
         return -1;
     close( *pfd );
-    *pfd = -1;
+    *pfd = sendfd = -1;
     return 0;
 }
 
@@ -446,7 +456,7 @@ static int connect_srv( int *pfd, const char *host, const char *service )
         DLOG( "set_nonblocking() failed: %m.\n" );
     if ( 0 != set_cloexec( fd ) )
         DLOG( "set_cloexec() failed: %m.\n" );
-    *pfd = fd;
+    *pfd = sendfd = fd;
     return 0;
 }
 
@@ -456,45 +466,128 @@ static int connect_srv( int *pfd, const char *host, const char *service )
  *
  */
 
-/* Receive buffer. */
+/* Message being received, and raw receive buffer. */
 static mbuf_t *rbuf = NULL;
-/* Send queue. */
+static uint8_t rx[RX_BUF_SIZE];
+/* Send queue, and the last control message in it. */
 static mbuf_t *qhead = NULL, *qtail = NULL;
+static mbuf_t *qctl = NULL;
 /* List of requests pending a response. */
 static mbuf_t *requests = NULL;
 
-/* Add message to send queue. */
+/* Local copy of the peer list, kept up to date by presence indications
+ * while subscribed. */
+typedef struct {
+    uint64_t id;
+    char *name;
+} peer_t;
+
+static struct {
+    bool sub;
+    uint64_t self;
+    peer_t *p;
+    size_t n, sz;
+} peers;
+
+/* Account for sent bytes, removing completely sent messages from
+ * the send queue. */
+static int dequeue_msg( size_t sent )
+{
+    mbuf_t *m;
+
+    while ( NULL != ( m = qhead ) )
+    {
+        if ( m->bsize - m->boff > sent )
+        {   /* Partially sent, carry on later. */
+            m->boff += sent;
+            break;
+        }
+        sent -= m->bsize - m->boff;
+        //DLOG( "\n" ); mbuf_dump( m );
+        qhead = m->next;
+        if ( qtail == m )
+            qtail = NULL;
+        if ( qctl == m )
+            qctl = NULL;
+        if ( HDR_CLASS_IS_REQ( m ) )
+        {   /* Move request to pending list. */
+            //DLOG( "Move to pending:\n" ); mbuf_dump( m );
+            m->next = requests;
+            requests = m;
+        }
+        else
+            mbuf_free( &m );
+    }
+    return 0;
+}
+
+/* Write as much of the send queue as possible at once. Returns the
+ * result of writev(). */
+static int send_queued( int fd )
+{
+    struct iovec iov[MBUF_IOV_MAX];
+    size_t len;
+    int n, w;
+
+    n = mbuf_iovec( qhead, iov, MBUF_IOV_MAX, MBUF_IOV_BUDGET, &len );
+    w = writev( fd, iov, n );
+    if ( 0 < w )
+        dequeue_msg( w );
+    return w;
+}
+
+/* Put a control message in the busy send queue ahead of all file data
+ * not being sent yet, but behind earlier control messages and messages
+ * of the same transfer. */
+static void queue_urgent( mbuf_t *m )
+{
+    uint64_t dst = HDR_GET_DSTID( m ), oid = mbuf_offerid( m );
+    mbuf_t *p = qctl;
+
+    if ( NULL == p && 0 < qhead->boff )
+        p = qhead;
+    for ( mbuf_t *q = NULL != p ? p->next : qhead; NULL != q; q = q->next )
+        if ( HDR_GET_DSTID( q ) == dst && mbuf_offerid( q ) == oid )
+            p = q;
+    if ( NULL != p )
+    {
+        m->next = p->next;
+        p->next = m;
+    }
+    else
+    {
+        m->next = qhead;
+        qhead = m;
+    }
+    if ( NULL == m->next )
+        qtail = m;
+    qctl = m;
+}
+
+/* Add message to send queue; anything but file data goes first. Requests
+ * to peers are stamped with the time to wait for their response. */
 static int enqueue_msg( mbuf_t *m )
 {
     //DLOG( "\n" ); mbuf_dump( m );
+    if ( HDR_CLASS_IS_REQ( m ) && 0ULL != HDR_GET_DSTID( m ) && 0 == mbuf_ttl( m ) )
+        mbuf_addattrib( &m, MSG_ATTR_TTL, 8, (uint64_t)cfg.resp_timeout * NT_MS_PER_S );
     m->boff = 0;
     m->next = NULL;
+    if ( NULL != qhead && MSG_TYPE_GETFILE_RES != HDR_GET_TYPE( m ) )
+    {
+        queue_urgent( m );
+        return 0;
+    }
     if ( NULL != qtail )
         qtail->next = m;
     qtail = m;
     if ( NULL == qhead )
+    {   /* Idle connection, try to send right away. Errors surface
+         * again in the main loop. */
         qhead = m;
-    return 0;
-}
-
-/* Remove message from send queue. */
-static int dequeue_msg( void )
-{
-    mbuf_t *next;
-
-    //DLOG( "\n" ); mbuf_dump( qhead );
-    next = qhead->next;
-    if ( qtail == qhead )
-        qtail = NULL;
-    if ( HDR_CLASS_IS_REQ( qhead ) )
-    {   /* Move request to pending list. */
-        //DLOG( "Move to pending:\n" ); mbuf_dump( qhead );
-        qhead->next = requests;
-        requests = qhead;
+        if ( 0 <= sendfd )
+            send_queued( sendfd );
     }
-    else
-        mbuf_free( &qhead );
-    qhead = next;
     return 0;
 }
 
@@ -522,6 +615,54 @@ static mbuf_t *match_pending_req( const mbuf_t *m )
     return q;
 }
 
+/* Empty the local peer list, and set the subscription state. */
+static void peers_clear( bool sub )
+{
+    for ( size_t i = 0; i < peers.n; ++i )
+        free( peers.p[i].name );
+    peers.n = 0;
+    peers.sub = sub;
+}
+
+static ssize_t peers_find( uint64_t id )
+{
+    for ( size_t i = 0; i < peers.n; ++i )
+        if ( peers.p[i].id == id )
+            return i;
+    return -1;
+}
+
+/* Add a peer to the local list, or rename it, if already present. */
+static void peers_set( uint64_t id, const char *name )
+{
+    ssize_t i = peers_find( id );
+
+    if ( 0 > i )
+    {
+        if ( peers.n == peers.sz )
+        {
+            peers.sz = peers.sz ? peers.sz * 2 : 64;
+            peers.p = realloc_s( peers.p, peers.sz * sizeof *peers.p );
+        }
+        i = peers.n++;
+        peers.p[i].id = id;
+    }
+    else
+        free( peers.p[i].name );
+    peers.p[i].name = strdup_s( name );
+}
+
+static void peers_unset( uint64_t id )
+{
+    ssize_t i = peers_find( id );
+
+    if ( 0 <= i )
+    {
+        free( peers.p[i].name );
+        peers.p[i] = peers.p[--peers.n];
+    }
+}
+
 /* clear out the pending request and offer lists. */
 static void upkeep_pending( void )
 {
@@ -669,9 +810,9 @@ static int process_stdin( int *srvfd )
         { "list",       CMD_LIST,       "\t\t\tlist active transfers / open offers" },
         { "login",      CMD_LOGIN,      " [user [passwd]]\tlog on to connected server" },
         { "logout",     CMD_LOGOUT,     "\t\t\tlog off from connected server" },
-        { "offer",      CMD_OFFER,      " peer_id filename\tplace an offer" },
+        { "offer",      CMD_OFFER,      " peer_id[,..] file\tplace an offer" },
         { "open",       CMD_CONNECT,    "\t\t\tsame as 'connect'" },
-        { "peerlist",   CMD_PEERLIST,   "\t\tget list of peers active on server" },
+        { "peerlist",   CMD_PEERLIST,   " [on|off|prefix]\tget list of peers active on server, (un)subscribe to changes" },
         { "ping",       CMD_PING,       " [peer_id [text]]\tping server or peer" },
         { "pwd",        CMD_PWD,        "\t\t\tprint current working directory" },
         { "quit",       CMD_EXIT,       "\t\t\tsame as 'exit'" },
@@ -712,38 +853,73 @@ static int process_stdin( int *srvfd )
             mbuf_addattrib( &mp, MSG_ATTR_NOTICE, strlen( cp ) + 1, cp );
         }
         break;
-    case CMD_PEERLIST:  /* peerlist */
-        mbuf_compose( &mp, MSG_TYPE_PEERLIST_REQ, 0, 0, prng_random() );
+    case CMD_PEERLIST:  /* peerlist [on|off|prefix] */
+        if ( 1 < a && ( 0 == stricmp( arg[1], "on" ) || 0 == stricmp( arg[1], "off" ) ) )
+        {
+            mbuf_compose( &mp, MSG_TYPE_PEERLIST_REQ, 0, 0, prng_random() );
+            mbuf_addattrib( &mp, MSG_ATTR_SUBSCRIBE, 8, (uint64_t)( 0 == stricmp( arg[1], "on" ) ) );
+        }
+        else if ( 1 < a )
+        {
+            mbuf_compose( &mp, MSG_TYPE_PEERLIST_REQ, 0, 0, prng_random() );
+            mbuf_addattrib( &mp, MSG_ATTR_PREFIX, strlen( arg[1] ) + 1, arg[1] );
+        }
+        else if ( peers.sub && CLT_AUTH_OK == cfg.st )
+        {   /* Local copy is kept current by the server. */
+            printcon( PFX_PLST, NULL );
+            for ( size_t i = 0; i < peers.n; ++i )
+                printcon( PFX_PLST, "%016"PRIx64"%s %s\n", peers.p[i].id,
+                        ( peers.self == peers.p[i].id ) ? "*" : " ", peers.p[i].name );
+            r = 1;
+        }
+        else
+            mbuf_compose( &mp, MSG_TYPE_PEERLIST_REQ, 0, 0, prng_random() );
         break;
-    case CMD_OFFER:     /* offer destination file [notice] */
+    case CMD_OFFER:     /* offer destination[,destination...] file [notice] */
         if ( 3 > a )
         {
-            printcon( PFX_CERR, "Usage: offer destination file\n" );
+            printcon( PFX_CERR, "Usage: offer destination[,destination...] file\n" );
             r = -1;
         }
         else
         {
-            const transfer_t *o;
-            char *bname, *fname;
+            transfer_t *o;
+            char *bname, *fname, *end;
+            const char *dp = arg[1];
+            uint64_t oid = 0;
             if ( CLT_AUTH_OK != cfg.st )
             {   /* Avoid creating bogus entries in transfer list! */
                 printcon( PFX_CERR, "Not logged in\n" );
                 r = -1;
                 break;
             }
-            if ( NULL == ( o = offer_new( strtoull( arg[1], NULL, 16 ), arg[2] ) ) )
+            /* Offers of a file to several peers share one offer ID, so
+             * the server may pass on chunks fetched once to all of them. */
+            for ( ;; )
             {
-                printcon( PFX_CERR, "No such file: '%s'\n", arg[2] );
-                r = -1;
-                break;
+                if ( NULL == ( o = offer_new( strtoull( dp, &end, 16 ), arg[2] ) ) )
+                {
+                    printcon( PFX_CERR, "No such file: '%s'\n", arg[2] );
+                    r = -1;
+                    break;
+                }
+                if ( 0 == oid )
+                    oid = o->oid;
+                else
+                    o->oid = oid;
+                mbuf_compose( &mp, MSG_TYPE_OFFER_REQ, 0, o->rid, prng_random() );
+                mbuf_addattrib( &mp, MSG_ATTR_OFFERID, 8, o->oid );
+                fname = strdup_s( arg[2] );
+                bname = basename( fname );
+                mbuf_addattrib( &mp, MSG_ATTR_FILENAME, strlen( bname ) + 1, bname );
+                free( fname );
+                mbuf_addattrib( &mp, MSG_ATTR_SIZE, 8, o->size );
+                if ( ',' != *end )
+                    break;
+                dp = end + 1;
+                enqueue_msg( mp );
+                mp = NULL;
             }
-            mbuf_compose( &mp, MSG_TYPE_OFFER_REQ, 0, o->rid, prng_random() );
-            mbuf_addattrib( &mp, MSG_ATTR_OFFERID, 8, o->oid );
-            fname = strdup_s( arg[2] );
-            bname = basename( fname );
-            mbuf_addattrib( &mp, MSG_ATTR_FILENAME, strlen( bname ) + 1, bname );
-            free( fname );
-            mbuf_addattrib( &mp, MSG_ATTR_SIZE, 8, o->size );
         }
         break;
     case CMD_ACCEPT:    /* accept offer_id */
@@ -1002,6 +1178,7 @@ static int process_srvmsg( mbuf_t **pp )
     void *av, *av2;
     int res = 0;
     enum SC_ENUM status = SC_OK;
+    uint64_t ttl;
     static char buf[PATH_MAX];
 
     DLOG( "Received %s_%s from %016"PRIx64".\n", mtype2str( mtype ), mclass2str( mtype ), srcid );
@@ -1031,6 +1208,29 @@ static int process_srvmsg( mbuf_t **pp )
             }
         }
         break;
+    case MSG_TYPE_PEERLIST_IND:
+        if ( CLT_AUTH_OK == cfg.st && 0ULL == srcid && peers.sub )
+        {
+            while ( 0 == mbuf_getnextattrib( *pp, &at, &al, &av )
+                && ( MSG_ATTR_PEERID == at || MSG_ATTR_PEERGONE == at )
+                && 0 == mbuf_getnextattrib( *pp, &at2, &al2, &av2 )
+                && MSG_ATTR_PEERNAME == at2 )
+            {
+                uint64_t id = NTOH64( *(uint64_t *)av );
+                if ( MSG_ATTR_PEERID == at )
+                {
+                    peers_set( id, (char *)av2 );
+                    printcon( PFX_PADD, "%016"PRIx64"%s %s\n", id,
+                            ( peers.self == id ) ? "*" : " ", (char *)av2 );
+                }
+                else
+                {
+                    peers_unset( id );
+                    printcon( PFX_PDEL, "%016"PRIx64"  %s\n", id, (char *)av2 );
+                }
+            }
+        }
+        break;
     case MSG_TYPE_OFFER_REQ:
         if ( CLT_AUTH_OK == cfg.st )
         {
@@ -1100,6 +1300,10 @@ static int process_srvmsg( mbuf_t **pp )
             o->offset = offset + size;
             mbuf_compose( &mp, MSG_TYPE_GETFILE_RES, 0, srcid, trfid );
             mbuf_addattrib( &mp, MSG_ATTR_OFFERID, 8, oid );
+            /* The TTL goes ahead of the data, for the server to see it
+             * before passing the data on. */
+            if ( 0 != ( ttl = mbuf_ttl( *pp ) ) )
+                mbuf_addattrib( &mp, MSG_ATTR_TTL, 8, ttl );
             mbuf_addattrib( &mp, MSG_ATTR_DATA, size, data );
             free( data );
             if ( 0 < size )
@@ -1141,7 +1345,10 @@ static int process_srvmsg( mbuf_t **pp )
         {
             uint64_t oid = NTOH64( *(uint64_t *)av );
             transfer_t *d = transfer_match( TTYPE_DOWNLOAD, srcid, oid );
-            if ( 0 != mbuf_getnextattrib( *pp, &at, &al, &av )
+            int r = mbuf_getnextattrib( *pp, &at, &al, &av );
+            if ( 0 == r && MSG_ATTR_TTL == at )
+                r = mbuf_getnextattrib( *pp, &at, &al, &av );
+            if ( 0 != r
                 || MSG_ATTR_DATA != at
                 || NULL == d )
             {
@@ -1183,7 +1390,27 @@ static int process_srvmsg( mbuf_t **pp )
     case MSG_TYPE_PEERLIST_RES:
         if ( CLT_AUTH_OK == cfg.st && 0ULL == srcid )
         {
-            printcon( PFX_PLST, NULL );
+            bool fill = false, cont = false;
+            const char *prefix = NULL;
+            /* An (un)subscribe request resets the local copy, and
+             * continued queries extend the list already printed. */
+            mbuf_resetgetattrib( qmatch );
+            while ( 0 == mbuf_getnextattrib( qmatch, &at, &al, &av ) )
+            {
+                if ( MSG_ATTR_SUBSCRIBE == at )
+                {
+                    peers_clear( 0 != NTOH64( *(uint64_t *)av ) );
+                    peers.self = HDR_GET_DSTID( *pp );
+                    fill = peers.sub;
+                }
+                else if ( MSG_ATTR_CURSOR == at )
+                    cont = true;
+                else if ( MSG_ATTR_PREFIX == at )
+                    prefix = av;
+            }
+            fill = ( fill || cont ) && peers.sub && NULL == prefix;
+            if ( !cont )
+                printcon( PFX_PLST, NULL );
             while ( 0 == mbuf_getnextattrib( *pp, &at, &al, &av )
                 && MSG_ATTR_PEERID == at
                 && 0 == mbuf_getnextattrib( *pp, &at2, &al2, &av2 )
@@ -1191,6 +1418,15 @@ static int process_srvmsg( mbuf_t **pp )
             {
                 printcon( PFX_PLST, "%016"PRIx64"%s %s\n", NTOH64( *(uint64_t *)av ),
                         (HDR_GET_DSTID(*pp)==NTOH64( *(uint64_t *)av ))?"*":" ",  (char *)av2  );
+                if ( fill )
+                    peers_set( NTOH64( *(uint64_t *)av ), (char *)av2 );
+            }
+            if ( MSG_ATTR_CURSOR == at )
+            {   /* More to come, ask for the next page. */
+                mbuf_compose( &mp, MSG_TYPE_PEERLIST_REQ, 0, 0, prng_random() );
+                if ( NULL != prefix )
+                    mbuf_addattrib( &mp, MSG_ATTR_PREFIX, strlen( prefix ) + 1, prefix );
+                mbuf_addattrib( &mp, MSG_ATTR_CURSOR, al, av );
             }
         }
         break;
@@ -1228,6 +1464,7 @@ static int process_srvmsg( mbuf_t **pp )
             if ( MSG_ATTR_OK == at )
             {   /* Unregistered user. */
                 cfg.st = CLT_AUTH_OK;
+                peers_clear( false );
                 printcon( PFX_AUTH, "No authentication required\n" );
             }
             else if ( MSG_ATTR_CHALLENGE == at )
@@ -1258,6 +1495,7 @@ static int process_srvmsg( mbuf_t **pp )
             if ( 0 == mbuf_getnextattrib( *pp, &at, &al, &av ) && MSG_ATTR_NOTICE == at )
                 printcon( PFX_SMSG, "%s\n", (char *)av );
             cfg.st = CLT_AUTH_OK;
+            peers_clear( false );
         }
         break;
     case MSG_TYPE_LOGOUT_RES:
@@ -1301,9 +1539,13 @@ static int process_srvmsg( mbuf_t **pp )
     }
 DONE:
     mbuf_free( &qmatch );
+    /* Responses are of no use past the deadline of the request. */
+    ttl = HDR_CLASS_IS_REQ( *pp ) ? mbuf_ttl( *pp ) : 0;
     if ( SC_OK != status )
     {
         mbuf_to_error_response( pp, status );
+        if ( 0 != ttl )
+            mbuf_addattrib( pp, MSG_ATTR_TTL, 8, ttl );
         enqueue_msg( *pp );
         *pp = NULL;
         mbuf_free( &mp );
@@ -1311,7 +1553,11 @@ DONE:
     else
     {
         if ( NULL != mp )
+        {
+            if ( 0 != ttl && !HDR_CLASS_IS_REQ( mp ) && 0 == mbuf_ttl( mp ) )
+                mbuf_addattrib( &mp, MSG_ATTR_TTL, 8, ttl );
             enqueue_msg( mp );
+        }
         mbuf_free( pp );
     }
     return res;
@@ -1324,82 +1570,78 @@ static int handle_srvio( int nset, int *srvfd, fd_set *rfds, fd_set *wfds )
     /* Read from server. */
     if ( FD_ISSET( *srvfd, rfds ) )
     {
-        --nset;
-        /* Prepare receive buffer. */
-        if ( NULL == rbuf )
-            mbuf_new( &rbuf );
+        /* Complete a pending message in place, and read whatever else
+         * is available into the receive buffer. */
+        struct iovec iov[2];
+        const uint8_t *data = rx;
+        size_t len;
+        int n = 0, r;
 
-        if ( rbuf->boff < rbuf->bsize )
-        {   /* Message buffer not yet filled. */
-            int r;
-            errno = 0;
-            r = read( *srvfd, rbuf->b + rbuf->boff, rbuf->bsize - rbuf->boff );
-            if ( 0 > r )
-            {
-                if ( EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno )
-                {
-                    XLOG( LOG_ERR, "read() failed: %m.\n" );
-                    goto DISC;
-                }
-                goto SKIP_TO_WRITE;
-            }
-            if ( 0 == r )
+        --nset;
+        if ( NULL != rbuf )
+        {
+            iov[n].iov_base = rbuf->b + rbuf->boff;
+            iov[n++].iov_len = rbuf->bsize - rbuf->boff;
+        }
+        iov[n].iov_base = rx;
+        iov[n++].iov_len = sizeof rx;
+        errno = 0;
+        r = readv( *srvfd, iov, n );
+        if ( 0 > r )
+        {
+            if ( EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno )
             {
-                DLOG( "Remote host closed connection.\n" );
+                XLOG( LOG_ERR, "read() failed: %m.\n" );
                 goto DISC;
             }
-            //DLOG( "%d bytes received.\n", r );
-            rbuf->boff += r;
-        }
-        if ( rbuf->boff == rbuf->bsize )
-        {   /* Buffer filled. */
-            if ( rbuf->boff == MSG_HDR_SIZE )
-            {   /* Only received header yet. */
-                uint16_t paylen = HDR_GET_PAYLEN( rbuf );
-                if ( paylen > 0 )
-                {   /* Prepare to receive payload. */
-                    //DLOG( "Grow message buffer by %lu.\n", paylen );
-                    mbuf_resize( &rbuf, paylen );
-                }
-                //DLOG( "Expecting %"PRIu16" bytes of payload data.\n", paylen );
-            }
-            if ( rbuf->boff == rbuf->bsize )
-            {   /* Payload data complete. */
-                process_srvmsg( &rbuf );
-            }
+            goto SKIP_TO_WRITE;
         }
+        if ( 0 == r )
+        {
+            DLOG( "Remote host closed connection.\n" );
+            goto DISC;
+        }
+        //DLOG( "%d bytes received.\n", r );
+        len = r;
+        if ( NULL != rbuf )
+        {
+            size_t k = rbuf->bsize - rbuf->boff;
+
+            if ( k > len )
+                k = len;
+            rbuf->boff += k;
+            len -= k;
+        }
+        /* Process all messages completed so far. */
+        while ( mbuf_fill( &rbuf, &data, &len ) )
+            process_srvmsg( &rbuf );
     }
 SKIP_TO_WRITE:
     /* Write to server. */
     if ( 0 < nset && FD_ISSET( *srvfd, wfds ) )
-    {
+    {   /* Flush as much of the queue as possible at once. */
+        int w;
+
         --nset;
-        if ( qhead->boff < qhead->bsize )
-        {   /* Message buffer not yet fully sent. */
-            int w;
-            errno = 0;
-            w = write( *srvfd, qhead->b + qhead->boff, qhead->bsize - qhead->boff );
-            if ( 0 > w )
-            {
-                if ( EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno )
-                {
-                    XLOG( LOG_ERR, "write() failed: %m.\n" );
-                    goto DISC;
-                }
-                goto DONE;
-            }
-            if ( 0 == w )
+        if ( NULL == qhead )
+            goto DONE;
+        errno = 0;
+        w = send_queued( *srvfd );
+        if ( 0 > w )
+        {
+            if ( EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno )
             {
-                DLOG( "WTF, write() returned 0: %m.\n" );
+                XLOG( LOG_ERR, "writev() failed: %m.\n" );
                 goto DISC;
             }
-            //DLOG( "%d bytes sent to server.\n", w );
-            qhead->boff += w;
+            goto DONE;
         }
-        if ( qhead->boff == qhead->bsize )
-        {   /* Message sent, remove from queue. */
-            dequeue_msg();
+        if ( 0 == w )
+        {
+            DLOG( "WTF, writev() returned 0: %m.\n" );
+            goto DISC;
         }
+        //DLOG( "%d bytes sent to server.\n", w );
     }
 DONE:
     return nset;
@@ -0,0 +1,34 @@
+
+# Adjust to match your standard build system tools:
+export CC      ?= cc
+export LD      := $(CC)
+export STRIP   := strip
+export AR      := ar -rs
+
+# Do not edit these flags unless you really know what you're doing!
+export CFLAGS  := -std=c99 -pedantic -Wall -Wextra -I./lib -MMD -MP
+export CRFLAGS := -O2 -DNDEBUG
+export CDFLAGS := -O0 -DDEBUG -g3 -pg -ggdb
+
+# Generic tool shorts:
+export SH      := sh
+export CP      := cp -af
+export CPV     := cp -afv
+export MV      := mv -f
+export RM      := rm -rf
+export RMV     := rm -rfv
+export MKDIR   := mkdir -p
+export TOUCH   := touch
+export LN      := ln -sf
+export GZIP_C  := gzip -c
+UNAME_S := $(shell uname -s)
+ifeq ($(UNAME_S),FreeBSD)
+    export TAR := gtar
+else
+    export TAR := tar
+endif
+
+# Default install prefix:
+export PREFIX  ?= /usr/local
+
+# EOF
@@ -38,21 +38,175 @@
 #include <stdarg.h>
 #include <string.h>
 
+#include <pthread.h>
+
 #include <ntime.h>
 
 #include "util.h"
 
 
-mbuf_t *mbuf_new( mbuf_t **pp )
+/*
+ * mbuf pools: buffers come in a few fixed size classes and are
+ * recycled through small per-thread caches, backed by a shared depot
+ * that balances buffers allocated by one thread and released by
+ * another. Caches are never returned to the depot on thread exit.
+ */
+
+static const size_t cls_size[MBUF_NCLS] = {
+    MSG_HDR_SIZE, MBUF_SMALL_SIZE, MSG_MAX_SIZE
+};
+
+/* Buffers kept per thread, and in the shared depot, per class. */
+static const int cache_max[MBUF_NCLS] = { 256, 256, 32 };
+static const int depot_max[MBUF_NCLS] = { 4096, 4096, 256 };
+
+typedef
+    struct MCACHE_T_STRUCT
+    mcache_t;
+
+struct MCACHE_T_STRUCT {
+    mcache_t *nextc;
+    mbuf_t *free[MBUF_NCLS];
+    int nfree[MBUF_NCLS];
+    mbuf_pool_stat_t stat[MBUF_NCLS];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    mbuf_t *free[MBUF_NCLS];
+    int nfree[MBUF_NCLS];
+    mcache_t *caches;
+} depot = { PTHREAD_MUTEX_INITIALIZER, { NULL }, { 0 }, NULL };
+
+static __thread mcache_t *tcache = NULL;
+
+static mcache_t *mcache_get( void )
 {
+    if ( NULL == tcache )
+    {
+        tcache = malloc_s( sizeof *tcache );
+        memset( tcache, 0, sizeof *tcache );
+        pthread_mutex_lock( &depot.lock );
+        tcache->nextc = depot.caches;
+        depot.caches = tcache;
+        pthread_mutex_unlock( &depot.lock );
+    }
+    return tcache;
+}
+
+/* Count an event; counters are only ever written by the owning thread. */
+#define STAT_INC(V)     __atomic_store_n( &(V), (V) + 1, __ATOMIC_RELAXED )
+
+static int mbuf_class( size_t size )
+{
+    int c = 0;
+
+    while ( cls_size[c] < size )
+        ++c;
+    return c;
+}
+
+/* Move up to n buffers of class c from the list at *from to *to. */
+static int move_bufs( mbuf_t **from, mbuf_t **to, int n )
+{
+    int i;
+
+    for ( i = 0; i < n && NULL != *from; ++i )
+    {
+        mbuf_t *p = *from;
+        *from = p->next;
+        p->next = *to;
+        *to = p;
+    }
+    return i;
+}
+
+static mbuf_t *mbuf_alloc( int c )
+{
+    mcache_t *tc = mcache_get();
     mbuf_t *p;
 
-    /* We always start out just big enough to hold the header. */
-    p = malloc_s( sizeof *p + MSG_HDR_SIZE );
+    if ( NULL == tc->free[c] && 0 < __atomic_load_n( &depot.nfree[c], __ATOMIC_RELAXED ) )
+    {   /* Refill half the cache from the depot. */
+        int n;
+        pthread_mutex_lock( &depot.lock );
+        n = move_bufs( &depot.free[c], &tc->free[c], cache_max[c] / 2 );
+        depot.nfree[c] -= n;
+        pthread_mutex_unlock( &depot.lock );
+        tc->nfree[c] += n;
+    }
+    if ( NULL != ( p = tc->free[c] ) )
+    {
+        tc->free[c] = p->next;
+        --tc->nfree[c];
+        STAT_INC( tc->stat[c].hits );
+    }
+    else
+    {
+        p = malloc_s( sizeof *p + cls_size[c] );
+        STAT_INC( tc->stat[c].misses );
+    }
     p->next = NULL;
-    p->bsize = MSG_HDR_SIZE;
+    p->ext = NULL;
+    p->bcap = cls_size[c];
     p->boff = 0;
+    p->expire = 0;
     p->b = (uint8_t *)p + sizeof *p;
+    return p;
+}
+
+static void mbuf_release( mbuf_t *p )
+{
+    mcache_t *tc = mcache_get();
+    int c = mbuf_class( p->bcap );
+
+    if ( tc->nfree[c] >= cache_max[c] )
+    {   /* Spill half the cache to the depot, or the heap if full. */
+        mbuf_t *spill = NULL;
+        int n = move_bufs( &tc->free[c], &spill, cache_max[c] / 2 );
+        tc->nfree[c] -= n;
+        pthread_mutex_lock( &depot.lock );
+        if ( depot.nfree[c] + n <= depot_max[c] )
+        {
+            depot.nfree[c] += move_bufs( &spill, &depot.free[c], n );
+            spill = NULL;
+        }
+        pthread_mutex_unlock( &depot.lock );
+        while ( NULL != spill )
+        {
+            mbuf_t *next = spill->next;
+            free( spill );
+            spill = next;
+        }
+    }
+    p->next = tc->free[c];
+    tc->free[c] = p;
+    ++tc->nfree[c];
+}
+
+void mbuf_pool_stats( mbuf_pool_stat_t st[MBUF_NCLS] )
+{
+    memset( st, 0, MBUF_NCLS * sizeof *st );
+    pthread_mutex_lock( &depot.lock );
+    for ( mcache_t *tc = depot.caches; NULL != tc; tc = tc->nextc )
+    {
+        for ( int c = 0; c < MBUF_NCLS; ++c )
+        {
+            st[c].hits += __atomic_load_n( &tc->stat[c].hits, __ATOMIC_RELAXED );
+            st[c].misses += __atomic_load_n( &tc->stat[c].misses, __ATOMIC_RELAXED );
+        }
+    }
+    pthread_mutex_unlock( &depot.lock );
+}
+
+
+mbuf_t *mbuf_new( mbuf_t **pp )
+{
+    mbuf_t *p;
+
+    /* We always start out just big enough to hold the header. */
+    p = mbuf_alloc( MBUF_CLS_HDR );
+    p->bsize = MSG_HDR_SIZE;
     if ( NULL != pp )
         *pp = p;
     //DLOG( "New buffer address: %p\n", p );
@@ -62,7 +216,12 @@ mbuf_t *mbuf_new( mbuf_t **pp )
 void mbuf_free( mbuf_t **pp )
 {
     //DLOG( "Freeing buffer address: %p\n", *pp );
-    free( *pp );
+    if ( NULL != *pp )
+    {
+        if ( NULL != (*pp)->ext )
+            mshared_unref( &(*pp)->ext );
+        mbuf_release( *pp );
+    }
     *pp = NULL;
 }
 
@@ -71,17 +230,68 @@ mbuf_t *mbuf_resize( mbuf_t **pp, size_t paylen )
     /* CAVEAT: _Never_ resize an already chain-linked mbuf! */
     mbuf_t *p = *pp;
 
+    if ( NULL != p->ext )
+    {   /* Detach any shared payload, header stays in place. */
+        mshared_unref( &p->ext );
+        p->bsize = MSG_HDR_SIZE;
+    }
     paylen += MSG_HDR_SIZE;
     die_if( MSG_MAX_SIZE < paylen, "%d > MSG_MAX_SIZE!\n", paylen );
-    p = realloc_s( p, sizeof *p + paylen );
+    if ( paylen > p->bcap )
+    {   /* Move to a buffer of a larger class. */
+        mbuf_t *n = mbuf_alloc( mbuf_class( paylen ) );
+        n->next = p->next;
+        n->boff = p->boff;
+        n->expire = p->expire;
+        memcpy( n->b, p->b, p->bsize );
+        mbuf_release( p );
+        p = n;
+    }
     //DLOG( "Resized buffer %p: %zu to %zu\n", p, p->bsize, paylen );
-    p->b = (uint8_t *)p + sizeof *p;
     p->bsize = paylen;
     if ( p->boff > p->bsize )
         p->boff = p->bsize;
     return *pp = p;
 }
 
+/* Continue filling the message in *pp, allocated if necessary, from
+ * the *plen bytes at *pdata, advancing both past the bytes consumed.
+ * The buffer is grown to the full message size once the header is
+ * complete. Returns 1 if the message is complete, 0 if more data is
+ * needed. */
+int mbuf_fill( mbuf_t **pp, const uint8_t **pdata, size_t *plen )
+{
+    mbuf_t *p;
+
+    if ( NULL == *pp )
+    {
+        if ( 0 == *plen )
+            return 0;
+        mbuf_new( pp );
+    }
+    for ( ;; )
+    {
+        p = *pp;
+        if ( p->boff < p->bsize && 0 < *plen )
+        {
+            size_t n = p->bsize - p->boff;
+
+            if ( n > *plen )
+                n = *plen;
+            memcpy( p->b + p->boff, *pdata, n );
+            p->boff += n;
+            *pdata += n;
+            *plen -= n;
+        }
+        if ( p->boff < p->bsize )
+            return 0;
+        if ( MSG_HDR_SIZE < p->bsize || 0 == HDR_GET_PAYLEN( p ) )
+            return 1;
+        /* Header complete, make room for the payload. */
+        mbuf_resize( pp, HDR_GET_PAYLEN( p ) );
+    }
+}
+
 mbuf_t *mbuf_grow( mbuf_t **pp, size_t amount )
 {
     //DLOG( "Grow buffer %p by %zu\n", *pp, amount );
@@ -137,6 +347,91 @@ mbuf_t *mbuf_to_error_response( mbuf_t **pp, enum SC_ENUM ec )
     return *pp;
 }
 
+/* Replace the payload of an mbuf by a reference to a shared payload. */
+mbuf_t *mbuf_attach( mbuf_t **pp, mshared_t *s )
+{
+    die_if( MSG_MAX_PAY_SIZE < s->size, "%zu > MSG_MAX_PAY_SIZE!\n", s->size );
+    mbuf_resize( pp, 0 );
+    (*pp)->ext = mshared_ref( s );
+    (*pp)->bsize = MSG_HDR_SIZE + s->size;
+    HDR_SET_PAYLEN( *pp, s->size );
+    return *pp;
+}
+
+/* Get the longest contiguous run of bytes starting at offset off. */
+static size_t mbuf_run( const mbuf_t *p, size_t off, const uint8_t **pdata )
+{
+    if ( NULL == p->ext )
+    {
+        *pdata = p->b + off;
+        return p->bsize - off;
+    }
+    if ( MSG_HDR_SIZE > off )
+    {
+        *pdata = p->b + off;
+        return MSG_HDR_SIZE - off;
+    }
+    *pdata = p->ext->d + ( off - MSG_HDR_SIZE );
+    return p->bsize - off;
+}
+
+/* Gather the unsent parts of the chain starting at p into at most niov
+ * iovecs, limited to max bytes in total. Returns the number of iovecs
+ * filled, and the number of bytes they cover in *plen. */
+int mbuf_iovec( const mbuf_t *p, struct iovec *iov, int niov,
+                size_t max, size_t *plen )
+{
+    size_t total = 0;
+    int n = 0;
+
+    for ( ; NULL != p && n < niov && total < max; p = p->next )
+    {
+        size_t off = p->boff;
+
+        while ( off < p->bsize && n < niov && total < max )
+        {
+            const uint8_t *data;
+            size_t len = mbuf_run( p, off, &data );
+
+            if ( len > max - total )
+                len = max - total;
+            iov[n].iov_base = (void *)data;
+            iov[n].iov_len = len;
+            ++n;
+            off += len;
+            total += len;
+        }
+    }
+    *plen = total;
+    return n;
+}
+
+mshared_t *mshared_new( const void *data, size_t size )
+{
+    mshared_t *s;
+
+    s = malloc_s( sizeof *s + size );
+    s->refcnt = 1;
+    s->size = size;
+    s->d = (uint8_t *)s + sizeof *s;
+    if ( 0 < size )
+        memcpy( s->d, data, size );
+    return s;
+}
+
+mshared_t *mshared_ref( mshared_t *s )
+{
+    __atomic_add_fetch( &s->refcnt, 1, __ATOMIC_RELAXED );
+    return s;
+}
+
+void mshared_unref( mshared_t **ps )
+{
+    if ( NULL != *ps && 0 == __atomic_sub_fetch( &(*ps)->refcnt, 1, __ATOMIC_ACQ_REL ) )
+        free( *ps );
+    *ps = NULL;
+}
+
 
 enum AVTYPE {
     AVTYPE_NONE,
@@ -159,9 +454,13 @@ int mbuf_addattrib( mbuf_t **pp, enum MSG_ATTRIB attype, size_t length, ... )
     case MSG_ATTR_CHALLENGE:    avtype = AVTYPE_BLOB; break;
     case MSG_ATTR_DIGEST:       avtype = AVTYPE_BLOB; break;
     case MSG_ATTR_SIGNATURE:    avtype = AVTYPE_BLOB; break;
-    //case MSG_ATTR_TTL:          avtype = AVTYPE_UI64; length = 8; break;
+    case MSG_ATTR_TTL:          avtype = AVTYPE_UI64; length = 8; break;
     case MSG_ATTR_PEERID:       avtype = AVTYPE_UI64; length = 8; break;
     case MSG_ATTR_PEERNAME:     avtype = AVTYPE_STR;  break;
+    case MSG_ATTR_PEERGONE:     avtype = AVTYPE_UI64; length = 8; break;
+    case MSG_ATTR_SUBSCRIBE:    avtype = AVTYPE_UI64; length = 8; break;
+    case MSG_ATTR_CURSOR:       avtype = AVTYPE_STR;  break;
+    case MSG_ATTR_PREFIX:       avtype = AVTYPE_STR;  break;
     case MSG_ATTR_OFFERID:      avtype = AVTYPE_UI64; length = 8; break;
     case MSG_ATTR_FILENAME:     avtype = AVTYPE_STR;  break;
     case MSG_ATTR_SIZE:         avtype = AVTYPE_UI64; length = 8; break;
@@ -239,6 +538,70 @@ int mbuf_resetgetattrib( mbuf_t *p )
     return 0;
 }
 
+/* Get the TTL of a message being received, from the attributes ahead
+ * of its data, stored at *pttl, 0 if none. Returns 0 on success, or -1
+ * if those attributes have not all arrived yet. */
+int mbuf_head_ttl( const mbuf_t *p, uint64_t *pttl )
+{
+    size_t off = MSG_HDR_SIZE, len;
+
+    *pttl = 0;
+    while ( off + 8 <= p->boff )
+    {
+        int type = NTOH16( *(uint16_t *)ADDOFF( p, off ) );
+
+        if ( MSG_ATTR_DATA == type )
+            return 0;
+        len = NTOH16( *(uint16_t *)ADDOFF( p, off + 2 ) );
+        if ( off + 8 + ROUNDUP8( len ) > p->boff )
+            break;
+        if ( MSG_ATTR_TTL == type )
+        {
+            if ( 8 == len )
+                *pttl = NTOH64( *(uint64_t *)ADDOFF( p, off + 8 ) );
+            return 0;
+        }
+        off += 8 + ROUNDUP8( len );
+    }
+    return -1;
+}
+
+/* Get the payload of a message, in place or attached. */
+static const uint8_t *mbuf_payload( const mbuf_t *p )
+{
+    return NULL != p->ext ? p->ext->d : p->b + MSG_HDR_SIZE;
+}
+
+/* Get the offer a message refers to, or 0 if none; offer related
+ * messages carry the offer id as their first attribute. */
+uint64_t mbuf_offerid( const mbuf_t *p )
+{
+    const uint8_t *d = mbuf_payload( p );
+
+    if ( MSG_HDR_SIZE + 16 <= p->bsize
+        && MSG_ATTR_OFFERID == NTOH16( *(uint16_t *)d ) )
+        return NTOH64( *(uint64_t *)( d + 8 ) );
+    return 0;
+}
+
+/* Get the lifetime a message is stamped with, in milliseconds, or 0
+ * if it carries no TTL. */
+uint64_t mbuf_ttl( const mbuf_t *p )
+{
+    const uint8_t *d = mbuf_payload( p );
+    size_t off = 0, n = p->bsize - MSG_HDR_SIZE, len;
+
+    while ( off + 8 <= n )
+    {
+        len = NTOH16( *(uint16_t *)( d + off + 2 ) );
+        if ( MSG_ATTR_TTL == NTOH16( *(uint16_t *)( d + off ) ) )
+            return ( 8 == len && off + 16 <= n )
+                   ? NTOH64( *(uint64_t *)( d + off + 8 ) ) : 0;
+        off += 8 + ROUNDUP8( len );
+    }
+    return 0;
+}
+
 const char *mtype2str( int mtype )
 {
     switch ( MTYPE_CUT_CLASS( mtype ) )
@@ -290,7 +653,7 @@ extern void mbuf_dump( mbuf_t *m )
     if ( 0 != paylen )
     {
         DLOG( "Payload:\n" );
-        DLOGHEX( m->b + MSG_HDR_SIZE, paylen, 8 );
+        DLOGHEX( NULL != m->ext ? m->ext->d : m->b + MSG_HDR_SIZE, paylen, 8 );
     }
 }
 #endif
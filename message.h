@@ -38,6 +38,9 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
+
+#include <sys/uio.h>
 
 #include <bendian.h>
 
@@ -141,7 +144,7 @@ enum MSG_TYPE {
     MSG_TYPE_DROP_REQ      = (MTYPE_DROP | MCLASS_REQ),       // 0x0051,
     MSG_TYPE_DROP_RES      = (MTYPE_DROP | MCLASS_RES),       // 0x0052,
     MSG_TYPE_DROP_ERR      = (MTYPE_DROP |MCLASS_ERR),        // 0x005a,
-  //MSG_TYPE_PEERLIST_IND  = (MTYPE_PEERLIST | MCLASS_IND),   // 0x00a0,
+    MSG_TYPE_PEERLIST_IND  = (MTYPE_PEERLIST | MCLASS_IND),   // 0x00a0,
     MSG_TYPE_PEERLIST_REQ  = (MTYPE_PEERLIST | MCLASS_REQ),   // 0x00a1,
     MSG_TYPE_PEERLIST_RES  = (MTYPE_PEERLIST | MCLASS_RES),   // 0x00a2,
     MSG_TYPE_PEERLIST_ERR  = (MTYPE_PEERLIST | MCLASS_ERR),   // 0x00aa,
@@ -167,9 +170,13 @@ enum MSG_ATTRIB {
     MSG_ATTR_CHALLENGE  = 0x0003,
     MSG_ATTR_DIGEST     = 0x0004,
     MSG_ATTR_SIGNATURE  = 0x0005,
-    //MSG_ATTR_TTL        = 0x0008,
+    MSG_ATTR_TTL        = 0x0008,
     MSG_ATTR_PEERID     = 0x0010,
     MSG_ATTR_PEERNAME   = 0x0011,
+    MSG_ATTR_PEERGONE   = 0x0012,
+    MSG_ATTR_SUBSCRIBE  = 0x0013,
+    MSG_ATTR_CURSOR     = 0x0014,
+    MSG_ATTR_PREFIX     = 0x0015,
     MSG_ATTR_OFFERID    = 0x0021,
     MSG_ATTR_FILENAME   = 0x0022,
     MSG_ATTR_SIZE       = 0x0023,
@@ -182,30 +189,84 @@ enum MSG_ATTRIB {
 };
 
 
+typedef
+    struct MSHARED_T_STRUCT
+    mshared_t;
+
+/* Immutable, reference counted payload that can be attached to any
+ * number of mbufs without being copied. */
+struct MSHARED_T_STRUCT {
+    int refcnt;
+    size_t size;
+    uint8_t *d; /* Keep d the last member to preserve alignment! */
+};
+
 typedef
     struct MBUF_T_STRUCT
     mbuf_t;
 
+/* If ext is set, b holds only the header and the payload is taken
+ * from ext; bsize and boff still count the message as a whole. The
+ * buffer can grow up to bcap bytes without being reallocated. */
 struct MBUF_T_STRUCT {
     mbuf_t *next;
+    mshared_t *ext;
     size_t bsize;
+    size_t bcap;
     size_t boff;
+    time_t qtime;   /* time queued for sending, server only */
+    int64_t expire; /* monotonic deadline in ns or 0, server only */
     uint8_t *b; /* Keep b the last member to preserve alignment! */
 };
 
 
+/* Pool size classes for mbuf buffers, including the header. */
+enum MBUF_CLASS {
+    MBUF_CLS_HDR,       /* header only */
+    MBUF_CLS_SMALL,     /* control messages */
+    MBUF_CLS_MAX,       /* up to MSG_MAX_SIZE */
+    MBUF_NCLS
+};
+
+#define MBUF_SMALL_SIZE     512
+
+/* Limits for gathering a send queue into a single vectored write. */
+#define MBUF_IOV_MAX        64
+#define MBUF_IOV_BUDGET     (256 * 1024)
+
+typedef
+    struct {
+        unsigned long hits;     /* served from a pool */
+        unsigned long misses;   /* had to be malloc'ed */
+    }
+    mbuf_pool_stat_t;
+
+extern void mbuf_pool_stats( mbuf_pool_stat_t st[MBUF_NCLS] );
+
 extern mbuf_t *mbuf_new( mbuf_t **pp );
 extern void mbuf_free( mbuf_t **p );
 extern mbuf_t *mbuf_resize( mbuf_t **pp, size_t size );
 extern mbuf_t *mbuf_grow( mbuf_t **pp, size_t amount );
+extern int mbuf_fill( mbuf_t **pp, const uint8_t **pdata, size_t *plen );
 extern mbuf_t *mbuf_compose( mbuf_t **pp, enum MSG_TYPE type,
                     uint64_t srcid, uint64_t dstid, uint64_t trfid );
 extern mbuf_t *mbuf_to_response( mbuf_t **pp );
 extern mbuf_t *mbuf_to_error_response( mbuf_t **pp, enum SC_ENUM ec );
 
+extern mbuf_t *mbuf_attach( mbuf_t **pp, mshared_t *s );
+extern int mbuf_iovec( const mbuf_t *p, struct iovec *iov, int niov,
+                size_t max, size_t *plen );
+
+extern mshared_t *mshared_new( const void *data, size_t size );
+extern mshared_t *mshared_ref( mshared_t *s );
+extern void mshared_unref( mshared_t **ps );
+
 extern int mbuf_addattrib( mbuf_t **pp, enum MSG_ATTRIB attrib, size_t length, ... );
 extern int mbuf_getnextattrib( mbuf_t *p, enum MSG_ATTRIB *ptype, size_t *plen, void **pval );
 extern int mbuf_resetgetattrib( mbuf_t *p );
+extern int mbuf_head_ttl( const mbuf_t *p, uint64_t *pttl );
+extern uint64_t mbuf_offerid( const mbuf_t *p );
+extern uint64_t mbuf_ttl( const mbuf_t *p );
 
 extern const char *mtype2str( int mtype );
 extern const char *mclass2str( int mtype );
@@ -589,6 +589,20 @@ def peerlist_update(line):
             peerlist.insert(END, line)
         peerlist_lock.release()
 
+def peerlist_del(line):
+    peerid = line.split(None, 1)[0].rstrip('*').lstrip('0')
+    with peerlist_lock:
+        items = peerlist.get(0,END)
+        for idx, item in enumerate(items):
+            if item.split(None, 1)[0].rstrip('*') == peerid:
+                peerlist.delete(idx)
+                break
+
+def peerlist_add(line):
+    peerlist_del(line)
+    with peerlist_lock:
+        peerlist.insert(END, line.lstrip('0'))
+
 def peerlist_select(event=None):
     with peerlist_lock:
         if peerlist.size() > 0:
@@ -817,6 +831,7 @@ def subproc_clt():
             connstat.config(bg=scol_auth, text=line)
             loginbtn.config(text='Logout')
             logadd(line)
+            clt_write('peerlist on')
         elif pfx == 'NAUT':
             is_authed = False
             connstat.config(bg=scol_conn, text=line)
@@ -855,6 +870,12 @@ def subproc_clt():
         elif pfx == 'PLST':
             peerlist_update(line)
             logscrl = False
+        elif pfx == 'PADD':
+            peerlist_add(line)
+            logscrl = False
+        elif pfx == 'PDEL':
+            peerlist_del(line)
+            logscrl = False
     # Transfer list item
         elif pfx == 'TLST':
             translist_update(line)
@@ -898,7 +919,6 @@ def subrefresh_local():
 def subrefresh_remote():
     if is_authed:
         clt_write('ping 0');
-        clt_write('peerlist');
     else:
         peerlist.delete(0, END)
         pingstat.config(text='')
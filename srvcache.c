@@ -0,0 +1,341 @@
+/*
+ * srvcache.c
+ *
+ * Copyright 2016 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "srvcache.h"
+#include "util.h"
+
+
+/* Spill file slot size, enough for any message payload. */
+#define CACHE_SLOT_SIZE     (64 * 1024)
+
+/* Sizes of the tables of requests awaiting a response, and of peers
+ * allowed to be served an offer; entries are simply overwritten on
+ * collisions, which merely causes requests to be passed on. */
+#define CACHE_NPEND     4096
+#define CACHE_NGRANT    4096
+
+typedef
+    struct CHUNK_T_STRUCT
+    chunk_t;
+
+struct CHUNK_T_STRUCT {
+    uint64_t src, oid, off, size;   /* key */
+    chunk_t *hnext;                 /* next chunk in hash bucket */
+    chunk_t *prev, *next;           /* LRU list links, most recent first */
+    mshared_t *pay;                 /* payload, NULL while spilled */
+    size_t len;                     /* payload size */
+    long slot;                      /* spill file slot, or -1 */
+};
+
+typedef
+    struct {
+        chunk_t *head, *tail;
+        size_t bytes;
+    }
+    lru_t;
+
+/* Request passed on, src and dst as in the response; unused if src is 0. */
+typedef
+    struct {
+        uint64_t src, dst, trfid;
+        uint64_t oid, off, size;
+    }
+    pend_t;
+
+/* Peer dst answered by src for offer oid; unused if src is 0. */
+typedef
+    struct {
+        uint64_t src, oid, dst;
+    }
+    grant_t;
+
+static size_t mem_max = 0;
+static chunk_t **tab = NULL;    /* hash buckets */
+static unsigned tabmask = 0;
+static lru_t mem = { NULL, NULL, 0 };   /* chunks held in memory */
+static lru_t spill = { NULL, NULL, 0 }; /* chunks held in the spill file */
+static pend_t *pend = NULL;
+static grant_t *grant = NULL;
+static uint8_t *map = NULL;     /* spill file mapping */
+static long *freeslot = NULL;   /* stack of unused spill file slots */
+static long nfree = 0;
+static cache_stat_t cstat;
+
+
+static uint64_t mix( uint64_t h, uint64_t v )
+{
+    h ^= v;
+    h *= 0xff51afd7ed558ccdULL;
+    return h ^ ( h >> 33 );
+}
+
+static chunk_t **chunk_find( uint64_t src, uint64_t oid, uint64_t off, uint64_t size )
+{
+    chunk_t **pp = &tab[mix( mix( mix( mix( 0, src ), oid ), off ), size ) & tabmask];
+
+    while ( NULL != *pp && ( (*pp)->src != src || (*pp)->oid != oid
+                             || (*pp)->off != off || (*pp)->size != size ) )
+        pp = &(*pp)->hnext;
+    return pp;
+}
+
+static pend_t *pend_slot( uint64_t src, uint64_t dst, uint64_t trfid )
+{
+    return &pend[mix( mix( mix( 0, src ), dst ), trfid ) & ( CACHE_NPEND - 1 )];
+}
+
+static grant_t *grant_slot( uint64_t src, uint64_t oid, uint64_t dst )
+{
+    return &grant[mix( mix( mix( 0, src ), oid ), dst ) & ( CACHE_NGRANT - 1 )];
+}
+
+static void lru_unlink( lru_t *l, chunk_t *c )
+{
+    if ( NULL != c->prev )
+        c->prev->next = c->next;
+    else
+        l->head = c->next;
+    if ( NULL != c->next )
+        c->next->prev = c->prev;
+    else
+        l->tail = c->prev;
+    c->prev = c->next = NULL;
+    l->bytes -= c->len;
+}
+
+static void lru_push( lru_t *l, chunk_t *c )
+{
+    c->prev = NULL;
+    c->next = l->head;
+    if ( NULL != l->head )
+        l->head->prev = c;
+    else
+        l->tail = c;
+    l->head = c;
+    l->bytes += c->len;
+}
+
+/* Remove a chunk from the cache altogether. */
+static void chunk_drop( chunk_t *c )
+{
+    chunk_t **pp = chunk_find( c->src, c->oid, c->off, c->size );
+
+    *pp = c->hnext;
+    if ( NULL != c->pay )
+    {
+        lru_unlink( &mem, c );
+        mshared_unref( &c->pay );
+    }
+    else
+    {
+        lru_unlink( &spill, c );
+        freeslot[nfree++] = c->slot;
+    }
+    free( c );
+}
+
+/* Get back within the memory budget by moving the least recently used
+ * chunks to the spill file, making room there by dropping its least
+ * recently used ones, or by dropping them outright without a spill file. */
+static void chunk_trim( void )
+{
+    chunk_t *c;
+
+    while ( mem.bytes > mem_max && NULL != ( c = mem.tail ) )
+    {
+        if ( NULL == map )
+        {
+            chunk_drop( c );
+            continue;
+        }
+        if ( 0 == nfree )
+            chunk_drop( spill.tail );
+        lru_unlink( &mem, c );
+        c->slot = freeslot[--nfree];
+        memcpy( map + (size_t)c->slot * CACHE_SLOT_SIZE, c->pay->d, c->len );
+        mshared_unref( &c->pay );
+        lru_push( &spill, c );
+        ++cstat.spills;
+    }
+}
+
+int cache_init( size_t max, const char *spill_dir, size_t spill_max )
+{
+    unsigned n = 256;
+    long nslots = (long)( spill_max / CACHE_SLOT_SIZE );
+    char *path;
+    int fd, e;
+
+    mem_max = max;
+    while ( n < ( max + spill_max ) / ( 16 * 1024 ) && n < ( 1U << 24 ) )
+        n <<= 1;
+    tabmask = n - 1;
+    tab = malloc_s( n * sizeof *tab );
+    for ( unsigned i = 0; i < n; ++i )
+        tab[i] = NULL;
+    pend = malloc_s( CACHE_NPEND * sizeof *pend );
+    memset( pend, 0, CACHE_NPEND * sizeof *pend );
+    grant = malloc_s( CACHE_NGRANT * sizeof *grant );
+    memset( grant, 0, CACHE_NGRANT * sizeof *grant );
+    memset( &cstat, 0, sizeof cstat );
+    if ( NULL == spill_dir || '\0' == *spill_dir || 0 == nslots )
+        return 0;
+    /* The spill file is unlinked right away, so it never outlives us. */
+    path = strdupcat_s( spill_dir, "/frelay-cache-XXXXXX" );
+    fd = mkstemp( path );
+    if ( 0 <= fd )
+        unlink( path );
+    free( path );
+    if ( 0 > fd )
+        return -1;
+    /* Allocate the blocks up front, rather than fault on a full disk. */
+    if ( 0 != ( errno = posix_fallocate( fd, 0, (off_t)nslots * CACHE_SLOT_SIZE ) )
+        || MAP_FAILED == ( map = mmap( NULL, (size_t)nslots * CACHE_SLOT_SIZE,
+                                       PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) ) )
+    {
+        e = errno;
+        map = NULL;
+        close( fd );
+        return errno = e, -1;
+    }
+    close( fd );
+    freeslot = malloc_s( nslots * sizeof *freeslot );
+    while ( nfree < nslots )
+    {
+        freeslot[nfree] = nslots - 1 - nfree;
+        ++nfree;
+    }
+    return 0;
+}
+
+mshared_t *cache_get( uint64_t src, uint64_t dst,
+                      uint64_t oid, uint64_t off, uint64_t size )
+{
+    chunk_t *c = *chunk_find( src, oid, off, size );
+    const grant_t *g = grant_slot( src, oid, dst );
+    mshared_t *pay;
+
+    if ( NULL == c || g->src != src || g->oid != oid || g->dst != dst )
+    {
+        ++cstat.misses;
+        return NULL;
+    }
+    if ( NULL == c->pay )
+    {   /* Bring it back into memory. */
+        lru_unlink( &spill, c );
+        c->pay = mshared_new( map + (size_t)c->slot * CACHE_SLOT_SIZE, c->len );
+        freeslot[nfree++] = c->slot;
+        c->slot = -1;
+    }
+    else
+        lru_unlink( &mem, c );
+    lru_push( &mem, c );
+    pay = mshared_ref( c->pay );
+    chunk_trim();
+    ++cstat.hits;
+    return pay;
+}
+
+void cache_expect( uint64_t src, uint64_t dst, uint64_t trfid,
+                   uint64_t oid, uint64_t off, uint64_t size )
+{
+    pend_t *p = pend_slot( src, dst, trfid );
+
+    p->src = src;
+    p->dst = dst;
+    p->trfid = trfid;
+    p->oid = oid;
+    p->off = off;
+    p->size = size;
+}
+
+int cache_expected( uint64_t src, uint64_t dst, uint64_t trfid )
+{
+    const pend_t *p = pend_slot( src, dst, trfid );
+
+    return 0 != src && p->src == src && p->dst == dst && p->trfid == trfid;
+}
+
+int cache_put( uint64_t src, uint64_t dst, uint64_t trfid,
+               uint64_t oid, const void *pay, size_t len )
+{
+    pend_t *p = pend_slot( src, dst, trfid );
+    grant_t *g = grant_slot( src, oid, dst );
+    chunk_t **pp, *c;
+
+    if ( !cache_expected( src, dst, trfid ) || p->oid != oid )
+        return errno = ENOENT, -1;
+    p->src = 0;
+    g->src = src;
+    g->oid = oid;
+    g->dst = dst;
+    if ( NULL != *( pp = chunk_find( src, oid, p->off, p->size ) ) )
+        return 0;
+    if ( len > mem_max || len > CACHE_SLOT_SIZE )
+        return errno = EFBIG, -1;
+    c = malloc_s( sizeof *c );
+    c->src = src;
+    c->oid = oid;
+    c->off = p->off;
+    c->size = p->size;
+    c->hnext = NULL;
+    c->pay = mshared_new( pay, len );
+    c->len = len;
+    c->slot = -1;
+    *pp = c;
+    lru_push( &mem, c );
+    ++cstat.stores;
+    chunk_trim();
+    return 0;
+}
+
+void cache_stats( cache_stat_t *st )
+{
+    *st = cstat;
+    st->mem = mem.bytes;
+    st->spilled = spill.bytes;
+}
+
+/* EOF */
@@ -0,0 +1,95 @@
+/*
+ * srvcache.h
+ *
+ * Copyright 2016 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ */
+
+#ifndef SRVCACHE_H_INCLUDED
+#define SRVCACHE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "message.h"
+
+
+/* Relay cache for file chunks passed on in GETFILE responses, keyed by
+ * source peer, offer id, and the offset and size requested. As responses
+ * carry no offset, forwarded requests are noted to be matched with their
+ * responses by transaction id. A chunk is only served to peers the source
+ * answered a request for the same offer itself.
+ *
+ * Chunks are kept in memory up to a byte budget, in least recently used
+ * order; optionally, the least recently used ones spill to a memory
+ * mapped file instead of being dropped. Served chunks are payloads ready
+ * to be attached to a response.
+ *
+ * Not thread safe, callers have to serialize access. */
+typedef
+    struct {
+        unsigned long hits;     /* requests served */
+        unsigned long misses;   /* requests passed on */
+        unsigned long stores;   /* chunks added */
+        unsigned long spills;   /* chunks moved to the spill file */
+        size_t mem;             /* bytes held in memory */
+        size_t spilled;         /* bytes held in the spill file */
+    }
+    cache_stat_t;
+
+
+/* Set up the cache with a memory budget in bytes, and a spill file of
+ * spill_max bytes in directory spill_dir, unless NULL or empty. Fails
+ * with errno set if the spill file cannot be set up, but leaves the
+ * cache usable without it. */
+extern int cache_init( size_t mem_max, const char *spill_dir, size_t spill_max );
+
+/* Look up the chunk requested by dst from src, returning a reference
+ * to its payload, or NULL if there is none to be served to dst. */
+extern mshared_t *cache_get( uint64_t src, uint64_t dst,
+                             uint64_t oid, uint64_t off, uint64_t size );
+
+/* Note a request passed on from dst to src, and tell whether the
+ * response with the given transaction id is expected, respectively. */
+extern void cache_expect( uint64_t src, uint64_t dst, uint64_t trfid,
+                          uint64_t oid, uint64_t off, uint64_t size );
+extern int cache_expected( uint64_t src, uint64_t dst, uint64_t trfid );
+
+/* Store the payload of an expected response from src to dst, which
+ * is thereby allowed to be served chunks of the offer. */
+extern int cache_put( uint64_t src, uint64_t dst, uint64_t trfid,
+                      uint64_t oid, const void *pay, size_t len );
+
+extern void cache_stats( cache_stat_t *st );
+
+
+#endif /* ndef _H_INCLUDED */
+
+/* EOF */
@@ -48,13 +48,80 @@
 /* Default frelay service port. (Neighbor of the mumbler ^.^) */
 #define DEF_PORT        "64740"
 
-/* Maximum number of simultaneously connected clients,
- * typically limited to 1024 on Linux. */
+/* Maximum number of simultaneously connected clients, limited by
+ * the open files resource limit, and to 1024 with the select backend. */
 #define MAX_CLIENTS     100
 
-/* Server idle timeout (upkeep interval) in seconds. */
+/* Event notification backend: "select", or "epoll" or "uring" (Linux only);
+ * "uring" uses io_uring completions for client I/O, falling back to
+ * "epoll" where unavailable. */
+#ifdef __linux__
+#define EVENT_BACKEND   "epoll"
+#else
+#define EVENT_BACKEND   "select"
+#endif
+
+/* Number of reactor threads, each serving an equal share of the
+ * client slots. */
+#define REACTOR_THREADS 1
+
+/* MOTD refresh interval in seconds; client timeouts are tracked
+ * individually and do not depend on it. */
 #define SEL_TIMEOUT_S   10
 
+/* Interval in seconds to log statistics, e.g. buffer pool hit and miss
+ * counts; 0 disables it. */
+#define STATS_INTERVAL_S    0
+
+/* Minimum size in bytes of a write to be sent without copying the data
+ * (Linux only, epoll and select backends); 0 disables zero-copy sends. */
+#define ZEROCOPY_MIN_SIZE   0
+
+/* Output scheduling quantum in bytes: the share of output each client,
+ * and each flow of messages to a backlogged client, gets per round. */
+#define SCHED_QUANTUM   (64 * 1024)
+
+/* Per-client output queue watermarks in bytes: sources feeding a client
+ * whose queue exceeds the high mark are not read from until it drains to
+ * the low mark. */
+#define QUEUE_HIGH      (1024 * 1024)
+#define QUEUE_LOW       (256 * 1024)
+
+/* Total bytes queued for all clients, beyond which sources are not read
+ * from until three quarters of it are available again; 0 for no limit. */
+#define RELAY_BUDGET    (256 * 1024 * 1024)
+
+/* Slow consumer limits: clients are disconnected once the oldest message
+ * queued for them has waited this many seconds, or their queue exceeds
+ * this many bytes; 0 disables the respective limit. Both are off unless
+ * configured, e.g. to 60 seconds and 64 MiB. */
+#define QUEUE_MAX_AGE_S     0
+#define QUEUE_MAX_BYTES     0
+
+/* Clients are likewise disconnected once they have been draining a queue
+ * of more than this many bytes at less than this many bytes per second,
+ * measured since the queue last filled up and over at least the window
+ * given in seconds; 0 disables the check, the default. */
+#define QUEUE_MIN_RATE      0
+#define QUEUE_RATE_WINDOW_S 10
+
+/* Admission control: while any reactor takes longer than this many
+ * milliseconds per loop iteration, or more than this many bytes are
+ * queued in total, connections are left pending and logins refused;
+ * 0 disables the respective check. Both are off unless configured, e.g.
+ * to 250 milliseconds and 192 MiB. */
+#define ADMIT_MAX_LAG_MS    0
+#define ADMIT_MAX_QUEUED    0
+
+/* Chunk cache: memory budget in bytes for file chunks passed on in
+ * GETFILE responses, to answer identical requests of other recipients
+ * of an offer; 0 disables the cache. Chunks pushed out of memory spill
+ * to a file of the given size created in the given directory, unless
+ * that is empty. */
+#define CACHE_SIZE          0
+#define CACHE_SPILL_DIR     ""
+#define CACHE_SPILL_SIZE    (256 * 1024 * 1024)
+
 /* Maximum allowed intra-message receive gap in seconds. */
 #define MSG_TIMEOUT_S   5
 
@@ -78,6 +145,7 @@
 #define TXT_REGISTERED  "Account created / modified."
 #define TXT_DROPPED     "Account registration dropped."
 #define TXT_BYE         "Bye."
+#define TXT_BUSY        "Server busy, retry after a few seconds."
 
 
 #endif /* ndef _H_INCLUDED */
@@ -0,0 +1,148 @@
+/*
+ * srvcfg.h
+ *
+ * Copyright 2016 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ */
+
+
+#ifndef CONFIG_H_INCLUDED
+#define CONFIG_H_INCLUDED
+
+
+/* Default interface to bind to; empty string means: any. */
+#define DEF_INTERFACE   ""
+
+/* Default frelay service port. (Neighbor of the mumbler ^.^) */
+#define DEF_PORT        "64740"
+
+/* Maximum number of simultaneously connected clients, limited by
+ * the open files resource limit, and to 1024 with the select backend. */
+#define MAX_CLIENTS     100
+
+/* Event notification backend: "select", or "epoll" or "uring" (Linux only);
+ * "uring" uses io_uring completions for client I/O, falling back to
+ * "epoll" where unavailable. */
+#ifdef __linux__
+#define EVENT_BACKEND   "epoll"
+#else
+#define EVENT_BACKEND   "select"
+#endif
+
+/* Number of reactor threads, each serving an equal share of the
+ * client slots. */
+#define REACTOR_THREADS 1
+
+/* MOTD refresh interval in seconds; client timeouts are tracked
+ * individually and do not depend on it. */
+#define SEL_TIMEOUT_S   10
+
+/* Interval in seconds to log statistics, e.g. buffer pool hit and miss
+ * counts; 0 disables it. */
+#define STATS_INTERVAL_S    0
+
+/* Minimum size in bytes of a write to be sent without copying the data
+ * (Linux only, epoll and select backends); 0 disables zero-copy sends. */
+#define ZEROCOPY_MIN_SIZE   0
+
+/* Output scheduling quantum in bytes: the share of output each client,
+ * and each flow of messages to a backlogged client, gets per round. */
+#define SCHED_QUANTUM   (64 * 1024)
+
+/* Per-client output queue watermarks in bytes: sources feeding a client
+ * whose queue exceeds the high mark are not read from until it drains to
+ * the low mark. */
+#define QUEUE_HIGH      (1024 * 1024)
+#define QUEUE_LOW       (256 * 1024)
+
+/* Total bytes queued for all clients, beyond which sources are not read
+ * from until three quarters of it are available again; 0 for no limit. */
+#define RELAY_BUDGET    (256 * 1024 * 1024)
+
+/* Slow consumer limits: clients are disconnected once the oldest message
+ * queued for them has waited this many seconds, or their queue exceeds
+ * this many bytes; 0 disables the respective limit. Both are off unless
+ * configured, e.g. to 60 seconds and 64 MiB. */
+#define QUEUE_MAX_AGE_S     0
+#define QUEUE_MAX_BYTES     0
+
+/* Clients are likewise disconnected once they have been draining a queue
+ * of more than this many bytes at less than this many bytes per second,
+ * measured since the queue last filled up and over at least the window
+ * given in seconds; 0 disables the check, the default. */
+#define QUEUE_MIN_RATE      0
+#define QUEUE_RATE_WINDOW_S 10
+
+/* Admission control: while any reactor takes longer than this many
+ * milliseconds per loop iteration, or more than this many bytes are
+ * queued in total, connections are left pending and logins refused;
+ * 0 disables the respective check. Both are off unless configured, e.g.
+ * to 250 milliseconds and 192 MiB. */
+#define ADMIT_MAX_LAG_MS    0
+#define ADMIT_MAX_QUEUED    0
+
+/* Chunk cache: memory budget in bytes for file chunks passed on in
+ * GETFILE responses, to answer identical requests of other recipients
+ * of an offer; 0 disables the cache. Chunks pushed out of memory spill
+ * to a file of the given size created in the given directory, unless
+ * that is empty. */
+#define CACHE_SIZE          0
+#define CACHE_SPILL_DIR     ""
+#define CACHE_SPILL_SIZE    (256 * 1024 * 1024)
+
+/* Maximum allowed intra-message receive gap in seconds. */
+#define MSG_TIMEOUT_S   5
+
+/* Client TCP connection idle timeout in seconds. */
+#ifdef DEBUG
+#define CONN_TIMEOUT_S  60
+#else
+#define CONN_TIMEOUT_S  240
+#endif
+
+/* Configuration file */
+#define CONFIG_PATH     "/etc/frelay.conf"
+
+/* User database file */
+#define USERDB_PATH     "/var/lib/frelay/user.db"
+
+/* External command to produce a welcome message. */
+#define MOTD_CMD        "echo 'Welcome!'"
+
+/* Registration and logoff text messages. */
+#define TXT_REGISTERED  "Account created / modified."
+#define TXT_DROPPED     "Account registration dropped."
+#define TXT_BYE         "Bye."
+#define TXT_BUSY        "Server busy, retry after a few seconds."
+
+
+#endif /* ndef _H_INCLUDED */
+
+/* EOF */
@@ -37,6 +37,9 @@
  */
 
 #define _POSIX_C_SOURCE 201112L
+#ifdef __linux__
+    #define _DEFAULT_SOURCE     /* SO_REUSEPORT */
+#endif
 
 #include <errno.h>
 #include <inttypes.h>
@@ -48,28 +51,99 @@
 #include <time.h>
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
-#ifndef FD_COPY
-    /* According to POSIX fd_set is a structure type! */
-    #define FD_COPY(dst,src) (*(dst)=*(src))
-#endif
+#include <sys/uio.h>
 
+#include <ntime.h>
 #include <stricmp.h>
 
 #include "auth.h"
 #include "cfgparse.h"
 #include "message.h"
+#include "srvcache.h"
 #include "srvcfg.h"
+#include "srvpeers.h"
+#include "srvpoll.h"
+#include "srvsplice.h"
+#include "srvtimer.h"
 #include "srvuserdb.h"
+#include "srvzcopy.h"
 #include "util.h"
 #include "version.h"
 
 
+/* Maximum number of events processed per loop iteration. */
+#define MAX_EVENTS      256
+
+/* Maximum number of connections accepted per loop iteration. */
+#define ACCEPT_BATCH    64
+
+/* Size of the per-shard receive buffer, filled by a single read. */
+#define RX_BUF_SIZE     (256 * 1024)
+
+/* Minimum outstanding payload for a forwarded message to be passed on
+ * before it is received completely. */
+#define CUT_MIN_SIZE    (4 * 1024)
+
+/* Minimum outstanding payload for a forwarded message to be spliced. */
+#define SPLICE_MIN_SIZE (16 * 1024)
+
+/* Tell from its header whether a message is about control, rather than
+ * a chunk of data, and hence to be sent with priority. */
+#define IS_CONTROL(m)   ( MSG_TYPE_GETFILE_RES != HDR_GET_TYPE( m ) )
+
+/* Tell from its header whether a message is worth splicing. */
+#define IS_BULK(m)  ( MSG_TYPE_GETFILE_RES == HDR_GET_TYPE( m ) \
+                      && SPLICE_MIN_SIZE <= HDR_GET_PAYLEN( m ) )
+
+/* Maximum number of bytes written per loop iteration, before turning
+ * to input again. */
+#define SCHED_BUDGET    (1024 * 1024)
+
+/* Interval in milliseconds to check whether stalled clients may be read
+ * from again, in case a wakeup was missed. */
+#define STALL_CHECK_MS  100
+
+/* Interval in milliseconds to check whether connections may be accepted
+ * again after an overload. */
+#define ADMIT_CHECK_MS  100
+
+/* Interval in milliseconds to collect zero-copy send completions for
+ * closed connections, and the number of seconds to wait for them before
+ * resetting the connection. */
+#define ZC_REAP_MS      100
+#define ZC_LINGER_S     30
+
+/* Maximum number of sources told about transfers cut short by evicting
+ * a slow client. */
+#define EVICT_REPORT_MAX    64
+
+/* Current time in seconds on the monotonic clock; client timeouts and
+ * queue ages are measured on it, so that a stepped wall clock has no
+ * effect on them. */
+#define MONOTIME()  ( ntime_to_time_t( nclock_get() ) )
+
+/* Hint that more data of the same message is to follow immediately. */
+#ifndef MSG_MORE
+    #define MSG_MORE    0
+#endif
+
+/* File descriptors kept available for purposes other than clients. */
+#define RESERVED_FDS    16
+
+/* Poller tags for non-client file descriptors; clients use their slot. */
+enum POLLER_TAG {
+    TAG_LISTEN = -1,
+    TAG_STDIN = -2,
+    TAG_WAKE = -3,
+};
+
 enum CLT_STATE {
     CLT_INVALID = 0,
     CLT_PRE_LOGIN,
@@ -77,22 +151,180 @@ enum CLT_STATE {
     CLT_AUTH_OK
 };
 
-/* Client structure type */
+/* Large forwarded message, passed on from the source to the destination
+ * while still being received (cut-through). The message start received
+ * so far goes first, followed by the rest as it arrives, either through
+ * the message buffer or, for bulk data, through a pipe. Nothing queued
+ * for the destination meanwhile may overtake it. Both ends belong to the
+ * same shard. */
+typedef
+    struct FLOW_T_STRUCT
+    flow_t;
+
+struct FLOW_T_STRUCT {
+    int src, dst;               /* client slots, -1 once detached */
+    size_t left;                /* payload still to take from the source */
+    size_t size;                /* message size, charged to the destination */
+    mbuf_t *buf;                /* message, received up to buf->boff */
+    size_t sent;                /* part of buf passed on already */
+    spipe_t *pipe;              /* pipe for the rest, or NULL */
+    int full;                   /* pipe took no more, source not read */
+};
+
+/* Messages of one flow to a backlogged client, waiting to be moved to
+ * its send queue; flows are told apart by source and offer, and served
+ * in deficit round robin order. */
+typedef
+    struct SUBQ_T_STRUCT
+    subq_t;
+
+struct SUBQ_T_STRUCT {
+    uint64_t src, oid;          /* flow key */
+    mbuf_t *head, *tail;        /* queued messages */
+    size_t deficit;             /* bytes the flow may still send */
+    subq_t *next;               /* ring of backlogged flows */
+};
+
+/* Socket of a closed connection, kept open until the kernel is done with
+ * the buffers of its zero-copy sends. */
+typedef
+    struct ZC_GRAVE_T_STRUCT
+    zc_grave_t;
+
+struct ZC_GRAVE_T_STRUCT {
+    int fd;                     /* socket, shut down for writing */
+    uint32_t done;              /* zero-copy sends completed */
+    mbuf_t *head;               /* sent buffers awaiting send completion */
+    time_t since;               /* time the connection was closed */
+    zc_grave_t *next;
+};
+
+/* Client structure type, holding the state needed for I/O and routing;
+ * kept compact, as the client table is scanned on several occasions. */
 typedef
     struct CLIENT_T_STRUCT
     client_t;
 
 struct CLIENT_T_STRUCT {
     int fd;                     /* client socket file descriptor  */
+    enum CLT_STATE st;          /* client state */
+    time_t act;                 /* time of last activity (monotonic s) */
+    uint64_t id;                /* client id */
+    mbuf_t *rbuf;               /* receive buffer pointer */
+    mbuf_t *qhead, *qtail;      /* send buffer queue pointers */
+    mbuf_t *qctl;               /* last control message spliced in */
+    mbuf_t *chead, *ctail;      /* control messages yet to be moved */
+    uint64_t qflows;            /* flows with messages in the queue */
+    subq_t *sq;                 /* backlogged flows, last one served */
+    flow_t *rxflow, *txflow;    /* flows from and to this client */
+};
+
+/* Less frequently used per-client data, in a table parallel to the
+ * client table. */
+typedef
+    struct CLIENT_INFO_T_STRUCT
+    client_info_t;
+
+struct CLIENT_INFO_T_STRUCT {
     socklen_t addrlen;          /* client remote address length */
     struct sockaddr_in addr;    /* client remote address */
-    uint64_t id;                /* client id */
     char *name;                 /* associated user name */
     char *key;                  /* user key (registered users only) */
-    enum CLT_STATE st;          /* client state */
-    time_t act;                 /* time of last activity (s since epoch) */
-    mbuf_t *rbuf;               /* receive buffer pointer */
-    mbuf_t *qhead, *qtail;      /* send buffer queue pointers */
+    int bulk;                   /* last message received was a bulk one */
+    int zc;                     /* zero-copy sends enabled */
+    uint32_t zc_seq, zc_done;   /* zero-copy sends issued and completed */
+    mbuf_t *zc_head, *zc_tail;  /* sent buffers awaiting send completion */
+    int sched;                  /* in the shard's output ring */
+    int snext, sprev;           /* output ring links */
+    size_t deficit;             /* bytes the client may still be sent */
+    size_t qbytes;              /* bytes queued for sending */
+    size_t sending;             /* bytes of the queue passed to an
+                                   asynchronous send, until handled */
+    int choked;                 /* sources wait for the queue to drain */
+    int stall;                  /* slot of client waiting for, or -1 */
+    uint64_t stall_id;          /* id of that client at the time */
+    size_t drained;             /* bytes sent since the queue filled up */
+    time_t dsince;              /* time the queue last filled up */
+    uint64_t conn;              /* connection serial number */
+    int ctl;                    /* control-plane request pending */
+    uint8_t *held;              /* input received meanwhile */
+    size_t nheld;
+};
+
+/* Control-plane request, handed to the control thread along with the
+ * message, and back to the owning shard with the outcome. */
+typedef
+    struct CTL_JOB_T_STRUCT
+    ctl_job_t;
+
+struct CTL_JOB_T_STRUCT {
+    ctl_job_t *next;            /* control queue link */
+    struct SHARD_T_STRUCT *sh;  /* owning shard */
+    int slot;                   /* client slot */
+    uint64_t conn;              /* connection serial number of the client */
+    mbuf_t *m;                  /* request, turned into the response */
+    uint64_t id;                /* client id */
+    char *name;                 /* user name */
+    char *key;                  /* user key */
+    char *arg;                  /* digest or key to check or store */
+    int res;                    /* status code, 0 on success */
+};
+
+/* Requests passed to a shard by other shards, or the control thread. */
+enum SHARD_CMD {
+    CMD_KICK,                   /* close client in slot, if id still matches */
+    CMD_ADOPT,                  /* take over an accepted connection */
+    CMD_CTL,                    /* finish a control-plane request */
+};
+
+typedef
+    struct SHARD_CMD_T_STRUCT
+    shard_cmd_t;
+
+struct SHARD_CMD_T_STRUCT {
+    enum SHARD_CMD cmd;
+    int arg;                    /* client slot or socket file descriptor */
+    uint64_t id;                /* client id at time of request */
+    socklen_t addrlen;          /* remote address of adopted connection */
+    struct sockaddr_in addr;
+    ctl_job_t *job;             /* completed control-plane request */
+};
+
+/* Reactor shard structure type */
+typedef
+    struct SHARD_T_STRUCT
+    shard_t;
+
+struct SHARD_T_STRUCT {
+    int idx;                    /* shard index */
+    int lo, hi;                 /* owned client slots, [lo,hi) */
+    client_t *c;                /* client table, shared by all shards */
+    client_info_t *ci;          /* client info table, likewise */
+    poller_t *pl;               /* event poller */
+    twheel_t *tw;               /* client timers, indexed relative to lo */
+    pthread_t tid;              /* reactor thread */
+    mbuf_t *mbox;               /* lock-free MPSC hand-off stack */
+    int lfd;                    /* listening socket, per shard if SO_REUSEPORT works */
+    int wake[2];                /* self-pipe signalling hand-offs */
+    uint8_t *rx;                /* receive buffer, RX_BUF_SIZE bytes */
+    int *freeslot;              /* stack of unused slots */
+    int nfree;
+    int *active;                /* dense list of occupied slots */
+    int *apos;                  /* position in active list, relative to lo */
+    int nactive;
+    int rfirst, rlast;          /* ring of slots due for output, linked
+                                   through the client info, or -1 */
+    int nready;
+    int *stalled;               /* slots not read from for backpressure */
+    int nstalled;
+    zc_grave_t *graves;         /* closed connections with zero-copy
+                                   sends in flight */
+    ntime_t lag;                /* smoothed loop iteration time */
+    int paused;                 /* not accepting connections for now */
+    uint64_t nconn;             /* connections adopted so far */
+    pthread_mutex_t cmd_lock;   /* protects the command list below */
+    shard_cmd_t *cmd;           /* pending requests */
+    int ncmd, cmd_sz;
 };
 
 
@@ -108,6 +340,22 @@ static struct {
     const char *config_path;
     char *userdb_path;
     const char *motd_cmd;
+    char *event_backend;
+    int reactor_threads;
+    int stats_interval;
+    int zerocopy_min;
+    int sched_quantum;
+    int queue_high;
+    int queue_low;
+    int relay_budget;
+    int queue_max_age;
+    int queue_max_bytes;
+    int queue_min_rate;
+    int admit_max_lag;
+    int admit_max_queued;
+    int cache_size;
+    char *cache_spill_dir;
+    int cache_spill_size;
 } cfg;
 
 static cfg_parse_def_t cfgdef[] = {
@@ -119,9 +367,117 @@ static cfg_parse_def_t cfgdef[] = {
     { "max_clients",    CFG_PARSE_T_INT, &cfg.max_clients },
     { "userdb_path",    CFG_PARSE_T_STR, &cfg.userdb_path },
     { "motd_cmd",       CFG_PARSE_T_STR, &cfg.motd_cmd },
+    { "event_backend",  CFG_PARSE_T_STR, &cfg.event_backend },
+    { "reactor_threads", CFG_PARSE_T_INT, &cfg.reactor_threads },
+    { "stats_interval", CFG_PARSE_T_INT, &cfg.stats_interval },
+    { "zerocopy_min",   CFG_PARSE_T_INT, &cfg.zerocopy_min },
+    { "sched_quantum",  CFG_PARSE_T_INT, &cfg.sched_quantum },
+    { "queue_high",     CFG_PARSE_T_INT, &cfg.queue_high },
+    { "queue_low",      CFG_PARSE_T_INT, &cfg.queue_low },
+    { "relay_budget",   CFG_PARSE_T_INT, &cfg.relay_budget },
+    { "queue_max_age",  CFG_PARSE_T_INT, &cfg.queue_max_age },
+    { "queue_max_bytes", CFG_PARSE_T_INT, &cfg.queue_max_bytes },
+    { "queue_min_rate", CFG_PARSE_T_INT, &cfg.queue_min_rate },
+    { "admit_max_lag",  CFG_PARSE_T_INT, &cfg.admit_max_lag },
+    { "admit_max_queued", CFG_PARSE_T_INT, &cfg.admit_max_queued },
+    { "cache_size",     CFG_PARSE_T_INT, &cfg.cache_size },
+    { "cache_spill_dir", CFG_PARSE_T_STR, &cfg.cache_spill_dir },
+    { "cache_spill_size", CFG_PARSE_T_INT, &cfg.cache_spill_size },
     { NULL, CFG_PARSE_T_NONE, NULL }
 };
 
+/* Reactor shards; client slots are assigned to shards in equally
+ * sized contiguous ranges. */
+static shard_t *shards;
+static int nshards;
+static int shard_size;
+
+/* Global peer directory lock: the client state, id and name fields
+ * may be modified only by the owning shard while holding the lock
+ * for writing, and are read by other shards while holding it for
+ * reading, save for the route hint checks below. Also protects the
+ * MOTD. */
+static pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#define DIR_RDLOCK()    pthread_rwlock_rdlock( &dir_lock )
+#define DIR_WRLOCK()    pthread_rwlock_wrlock( &dir_lock )
+#define DIR_UNLOCK()    pthread_rwlock_unlock( &dir_lock )
+
+/* Route hints: the slot a client id was last found at, indexed by a
+ * hash of the id, or -1. Read and written without locking; a hint is
+ * only trusted after checking the slot's id and state, and deliveries
+ * to other shards are checked again by the owning shard on arrival. */
+static int *route;
+static unsigned route_mask;
+
+static unsigned route_hash( uint64_t id )
+{
+    id ^= id >> 33;
+    id *= 0xff51afd7ed558ccdULL;
+    id ^= id >> 33;
+    return (unsigned)id & route_mask;
+}
+
+/* Find an authenticated client slot by id, or return -1; the directory
+ * is consulted, under dir_lock, only if the route hint is stale. */
+static int route_lookup( client_t *c, uint64_t id )
+{
+    unsigned h = route_hash( id );
+    int i = __atomic_load_n( &route[h], __ATOMIC_RELAXED );
+
+    if ( 0 <= i && __atomic_load_n( &c[i].id, __ATOMIC_RELAXED ) == id
+        && CLT_AUTH_OK == __atomic_load_n( &c[i].st, __ATOMIC_RELAXED ) )
+        return i;
+    DIR_RDLOCK();
+    for ( i = pdir_byid( id, -1 ); 0 <= i; i = pdir_byid( id, i ) )
+        if ( CLT_AUTH_OK == c[i].st )
+            break;
+    DIR_UNLOCK();
+    if ( 0 <= i )
+        __atomic_store_n( &route[h], i, __ATOMIC_RELAXED );
+    return i;
+}
+
+/* Serialized PEERLIST payload, shared by all pending responses; it is
+ * dropped whenever the set of authenticated peers changes, and lazily
+ * rebuilt on the next request. Only replaced while holding dir_lock
+ * for writing, or atomically filled in while holding it for reading. */
+static mshared_t *peerlist_cache = NULL;
+
+/* Slots subscribed to presence indications, and the joins and leaves
+ * collected since they were last pushed out; protected by dir_lock. */
+static int *subs, *subpos, nsubs;
+static mbuf_t *presence = NULL;
+
+/* Bytes queued for all clients, set when sources wait for the total to
+ * drop, and the number of times sources were stalled, and slow clients
+ * evicted, so far. */
+static size_t relay_bytes = 0;
+static int relay_choked = 0;
+static unsigned long relay_stalls = 0;
+static unsigned long relay_evictions = 0;
+
+/* Number of times accepting connections was put off, and logins refused,
+ * due to overload. */
+static unsigned long admit_pauses = 0;
+static unsigned long admit_refusals = 0;
+
+/* Control-plane requests waiting to be served by the control thread,
+ * which is the only one to access the user database, so that the
+ * shards never wait for the user db file to be written. */
+static pthread_mutex_t ctl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ctl_cond = PTHREAD_COND_INITIALIZER;
+static ctl_job_t *ctl_head = NULL, *ctl_tail = NULL;
+static pthread_t ctl_tid;
+static pthread_t motd_tid;
+
+/* Protects the chunk cache, if enabled. */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Number of messages dropped for having outlived their TTL, per type. */
+#define TTL_NTYPES  ( ( MTYPE_PING >> 4 ) + 1 )
+static unsigned long ttl_drops[TTL_NTYPES];
+
 
 /**********************************************
  * INITIALIZATION
@@ -218,6 +574,22 @@ static int init_config( int argc, char *argv[] )
     cfg.config_path = strdup_s( CONFIG_PATH );
     cfg.userdb_path = strdup_s( USERDB_PATH );
     cfg.motd_cmd = strdup_s( MOTD_CMD );
+    cfg.event_backend = strdup_s( EVENT_BACKEND );
+    cfg.reactor_threads = REACTOR_THREADS;
+    cfg.stats_interval = STATS_INTERVAL_S;
+    cfg.zerocopy_min = ZEROCOPY_MIN_SIZE;
+    cfg.sched_quantum = SCHED_QUANTUM;
+    cfg.queue_high = QUEUE_HIGH;
+    cfg.queue_low = QUEUE_LOW;
+    cfg.relay_budget = RELAY_BUDGET;
+    cfg.queue_max_age = QUEUE_MAX_AGE_S;
+    cfg.queue_max_bytes = QUEUE_MAX_BYTES;
+    cfg.queue_min_rate = QUEUE_MIN_RATE;
+    cfg.admit_max_lag = ADMIT_MAX_LAG_MS;
+    cfg.admit_max_queued = ADMIT_MAX_QUEUED;
+    cfg.cache_size = CACHE_SIZE;
+    cfg.cache_spill_dir = strdup_s( CACHE_SPILL_DIR );
+    cfg.cache_spill_size = CACHE_SPILL_SIZE;
 
     /* Parse command line options. */
     eval_cmdline( argc, argv );
@@ -233,27 +605,14 @@ static int init_config( int argc, char *argv[] )
     return 0;
 }
 
-static int init_server( client_t **clients )
+/* Create a socket, set SO_REUSEADDR, and SO_REUSEPORT if asked to, then
+ * bind and listen. Returns the socket, or -1 if that did not work out on
+ * any interface. */
+static int open_listener( const char *iface, int reuseport )
 {
-    int res = 0;
-    const char *iface = ( cfg.interface && *cfg.interface ) ? cfg.interface : NULL;
-    int fd = -1;
+    int res, fd = -1;
     struct addrinfo hints, *info, *ai;
 
-    /* Initialize clients array. */
-    if( (int)FD_SETSIZE < cfg.max_clients )
-    {
-        XLOG( LOG_WARNING,
-            "Maximum number of clients trimmed down to FD_SETZIZE (%d).\n",
-            FD_SETSIZE );
-        cfg.max_clients = FD_SETSIZE;
-    }
-    *clients = malloc_s( cfg.max_clients * sizeof **clients );
-    memset( *clients, 0, cfg.max_clients * sizeof **clients );
-    for ( int i = 0; i < cfg.max_clients; ++i )
-        (*clients)[i].fd = -1;
-
-    /* Create socket, set SO_REUSEADDR, bind and listen. */
     memset( &hints, 0, sizeof hints );
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
@@ -268,12 +627,24 @@ static int init_server( client_t **clients )
         if ( 0 > ( fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol ) ) )
         {
             XLOG( LOG_WARNING, "socket() failed: %m.\n" );
+            continue;
+        }
+        if ( 0 != setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &set, sizeof set ) )
+        {
+            XLOG( LOG_WARNING, "setsockopt() failed: %m.\n" );
+            close( fd );
         }
-        else if ( 0 != setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &set, sizeof set ) )
+#ifdef SO_REUSEPORT
+        else if ( reuseport
+            && 0 != setsockopt( fd, SOL_SOCKET, SO_REUSEPORT, &set, sizeof set ) )
         {
             XLOG( LOG_WARNING, "setsockopt() failed: %m.\n" );
             close( fd );
         }
+#else
+        else if ( reuseport )
+            close( fd );
+#endif
         else if ( 0 != bind( fd, ai->ai_addr, ai->ai_addrlen ) )
         {
             XLOG( LOG_WARNING, "bind() failed: %m.\n" );
@@ -286,11 +657,162 @@ static int init_server( client_t **clients )
                     inet_ntoa( ain->sin_addr ) );
             break;
         }
+        fd = -1;
     }
     freeaddrinfo( info );
-    die_if( NULL == ai, "Unable to bind to any interface.\n" );
-    res = listen( fd, 1 );
-    die_if( 0 != res, "listen() failed: %m.\n" );
+    if ( 0 > fd )
+        return -1;
+    die_if( 0 != listen( fd, SOMAXCONN ), "listen() failed: %m.\n" );
+    die_if( 0 != set_nonblocking( fd ), "set_nonblocking() failed: %m.\n" );
+    return fd;
+}
+
+static int init_server( client_t **clients )
+{
+    const char *iface = ( cfg.interface && *cfg.interface ) ? cfg.interface : NULL;
+    int fd = -1, reuse;
+    int maxfds = 0x7fffffff;
+    struct rlimit rl;
+    client_info_t *cinfo;
+
+    /* Raise the open files limit as far as we are permitted to. */
+    if ( 0 == getrlimit( RLIMIT_NOFILE, &rl ) )
+    {
+        if ( rl.rlim_cur < rl.rlim_max )
+        {
+            rl.rlim_cur = rl.rlim_max;
+            if ( 0 != setrlimit( RLIMIT_NOFILE, &rl ) )
+                XLOG( LOG_WARNING, "setrlimit() failed: %m.\n" );
+            getrlimit( RLIMIT_NOFILE, &rl );
+        }
+        maxfds = ( RLIM_INFINITY == rl.rlim_cur || 0x7fffffff < rl.rlim_cur )
+                 ? 0x7fffffff : (int)rl.rlim_cur;
+    }
+
+    /* Set up reactor shards, each with its own event notification. */
+    nshards = cfg.reactor_threads;
+    if ( 1 > nshards )
+        nshards = 1;
+    if ( cfg.max_clients < nshards )
+        nshards = cfg.max_clients;
+    if ( 1 > cfg.sched_quantum )
+        cfg.sched_quantum = SCHED_QUANTUM;
+    if ( 1 > cfg.queue_high )
+        cfg.queue_high = QUEUE_HIGH;
+    if ( 0 > cfg.queue_low || cfg.queue_high < cfg.queue_low )
+        cfg.queue_low = cfg.queue_high / 4;
+    if ( 0 > cfg.relay_budget )
+        cfg.relay_budget = 0;
+    if ( 0 > cfg.queue_max_age )
+        cfg.queue_max_age = 0;
+    if ( 0 > cfg.queue_max_bytes )
+        cfg.queue_max_bytes = 0;
+    if ( 0 > cfg.queue_min_rate )
+        cfg.queue_min_rate = 0;
+    if ( 0 > cfg.admit_max_lag )
+        cfg.admit_max_lag = 0;
+    if ( 0 > cfg.admit_max_queued )
+        cfg.admit_max_queued = 0;
+    if ( 0 < cfg.cache_size )
+    {
+        if ( 0 > cfg.cache_spill_size )
+            cfg.cache_spill_size = 0;
+        if ( 0 != cache_init( cfg.cache_size, cfg.cache_spill_dir, cfg.cache_spill_size ) )
+            XLOG( LOG_WARNING, "Unable to set up chunk cache spill file in '%s': %m.\n",
+                    cfg.cache_spill_dir );
+    }
+    shards = malloc_s( nshards * sizeof *shards );
+    memset( shards, 0, nshards * sizeof *shards );
+    for ( int k = 0; k < nshards; ++k )
+    {
+        shards[k].idx = k;
+        shards[k].pl = poller_new( cfg.event_backend, maxfds );
+        die_if( 0 != pipe( shards[k].wake ), "pipe() failed: %m.\n" );
+        die_if( 0 != set_nonblocking( shards[k].wake[0] )
+                || 0 != set_nonblocking( shards[k].wake[1] ),
+                "set_nonblocking() failed: %m.\n" );
+        die_if( 0 != poller_add( shards[k].pl, shards[k].wake[0], TAG_WAKE, POLLER_IN ),
+                "Unable to watch wakeup pipe: %m.\n" );
+        pthread_mutex_init( &shards[k].cmd_lock, NULL );
+    }
+    XLOG( LOG_INFO, "Using %s event backend with %d reactor thread(s).\n",
+            poller_name( shards[0].pl ), nshards );
+
+    /* Initialize clients array. */
+    if( poller_maxfds( shards[0].pl ) - RESERVED_FDS * nshards < cfg.max_clients )
+    {
+        cfg.max_clients = poller_maxfds( shards[0].pl ) - RESERVED_FDS * nshards;
+        XLOG( LOG_WARNING,
+            "Maximum number of clients trimmed down to %d.\n", cfg.max_clients );
+    }
+    *clients = malloc_s( cfg.max_clients * sizeof **clients );
+    memset( *clients, 0, cfg.max_clients * sizeof **clients );
+    for ( int i = 0; i < cfg.max_clients; ++i )
+        (*clients)[i].fd = -1;
+    cinfo = malloc_s( cfg.max_clients * sizeof *cinfo );
+    memset( cinfo, 0, cfg.max_clients * sizeof *cinfo );
+    pdir_init( cfg.max_clients );
+    for ( route_mask = 1; route_mask < (unsigned)cfg.max_clients; route_mask <<= 1 )
+        continue;
+    route = malloc_s( route_mask * sizeof *route );
+    for ( unsigned h = 0; h < route_mask; ++h )
+        route[h] = -1;
+    --route_mask;
+    subs = malloc_s( cfg.max_clients * sizeof *subs );
+    subpos = malloc_s( cfg.max_clients * sizeof *subpos );
+    for ( int i = 0; i < cfg.max_clients; ++i )
+        subpos[i] = -1;
+    shard_size = ( cfg.max_clients + nshards - 1 ) / nshards;
+    for ( int k = 0; k < nshards; ++k )
+    {
+        shard_t *sh = &shards[k];
+        int n;
+
+        sh->c = *clients;
+        sh->ci = cinfo;
+        sh->lo = k * shard_size;
+        sh->hi = sh->lo + shard_size;
+        if ( sh->lo > cfg.max_clients )
+            sh->lo = cfg.max_clients;
+        if ( sh->hi > cfg.max_clients )
+            sh->hi = cfg.max_clients;
+        n = sh->hi - sh->lo;
+        sh->freeslot = malloc_s( ( n + 1 ) * sizeof *sh->freeslot );
+        sh->active = malloc_s( ( n + 1 ) * sizeof *sh->active );
+        sh->apos = malloc_s( ( n + 1 ) * sizeof *sh->apos );
+        sh->rfirst = sh->rlast = -1;
+        sh->stalled = malloc_s( ( n + 1 ) * sizeof *sh->stalled );
+        sh->rx = malloc_s( RX_BUF_SIZE );
+        /* Hand out lower slots first. */
+        for ( sh->nfree = 0; sh->nfree < n; ++sh->nfree )
+            sh->freeslot[sh->nfree] = sh->hi - 1 - sh->nfree;
+        sh->nactive = 0;
+        sh->tw = twheel_new( n,
+                                   ( cfg.conn_timeout > cfg.msg_timeout
+                                     ? cfg.conn_timeout : cfg.msg_timeout ) + 1,
+                                   MONOTIME() );
+    }
+
+    /* Give each shard a listening socket of its own, for the kernel to
+     * spread connections over, so that a new connection wakes only one
+     * shard; failing that, the shards share one. */
+    reuse = 1 < nshards;
+    for ( int k = 0; k < nshards; ++k )
+    {
+        if ( 0 == k || reuse )
+        {
+            if ( 0 > ( fd = open_listener( iface, reuse ) ) && reuse && 0 == k )
+            {
+                XLOG( LOG_WARNING, "Unable to listen per reactor thread, sharing one socket.\n" );
+                reuse = 0;
+                fd = open_listener( iface, 0 );
+            }
+            die_if( 0 > fd, "Unable to listen on any interface.\n" );
+        }
+        shards[k].lfd = fd;
+        die_if( 0 != poller_add( shards[k].pl, fd, TAG_LISTEN, POLLER_IN ),
+                "Unable to watch listening socket: %m.\n" );
+    }
     XLOG( LOG_INFO, "Server listening on port %s.\n", cfg.listenport );
     return fd;
 }
@@ -301,13 +823,16 @@ static int init_server( client_t **clients )
  *
  */
 
+/* The MOTD is protected by the directory lock, the scratch buffer is
+ * only used by the MOTD thread refreshing it. */
 static char motd[4000] = "Welcome!";
+static char motd_buf[sizeof motd];
 static size_t motd_sz = 0;
 
 static int motd_cb( const char *s )
 {
-    if ( strlen( s ) < sizeof motd - motd_sz )
-        strcpy( motd + motd_sz, s );
+    if ( strlen( s ) < sizeof motd_buf - motd_sz )
+        strcpy( motd_buf + motd_sz, s );
     motd_sz += strlen( s );
     return 0;
 }
@@ -315,199 +840,1463 @@ static int motd_cb( const char *s )
 static const char *motd_get( void )
 {
     motd_sz = 0;
+    motd_buf[0] = '\0';
     pcmd( cfg.motd_cmd, motd_cb );
+    if ( 0 < motd_sz )
+    {
+        DIR_WRLOCK();
+        strcpy( motd, motd_buf );
+        DIR_UNLOCK();
+    }
     return motd;
 }
 
+/* MOTD thread: refreshes the MOTD periodically, on its own, so that a
+ * slow command holds up neither the shards nor the control plane. */
+static void *motd_run( void *arg )
+{
+    (void)arg;
+    for ( ;; )
+    {
+        motd_get();
+        sleep( 0 < cfg.select_timeout ? cfg.select_timeout : 1 );
+    }
+    return NULL;
+}
+
 
 /**********************************************
  * CLIENT PROCESSING
  *
  */
 
-static int close_client( client_t *cp, fd_set *m_rfds, fd_set *m_wfds )
+/* Discard the cached peer list; call with dir_lock held for writing. */
+static void peerlist_invalidate( void )
 {
-    DLOG( "Closing connection to [%s:%hu].\n",
-        inet_ntoa( cp->addr.sin_addr ), cp->addr.sin_port );
-    FD_CLR( cp->fd, m_rfds );
-    FD_CLR( cp->fd, m_wfds );
-    close( cp->fd );
-    free( cp->name );
-    free( cp->key );
-    mbuf_free( &cp->rbuf );
-    for ( mbuf_t *qp = cp->qhead, *next; NULL != qp; qp = next )
+    mshared_unref( &peerlist_cache );
+}
+
+/* Append one page of authenticated peers in name order to a message,
+ * optionally restricted to names starting with prefix, and resuming
+ * after the name passed as cursor. If not all matching peers fit, the
+ * page ends with a CURSOR attribute to pass in the next request. Call
+ * with dir_lock held. */
+static void peerlist_page( mbuf_t **pp, const client_t *c,
+                            const char *prefix, const char *cursor )
+{
+    const client_info_t *ci = shards[0].ci;
+    size_t plen = ( NULL != prefix ) ? strlen( prefix ) : 0;
+    size_t used = (*pp)->bsize - MSG_HDR_SIZE;
+    int pos = pdir_seek( prefix, 0 ), i, last = -1;
+
+    if ( NULL != cursor && pos < ( i = pdir_seek( cursor, 1 ) ) )
+        pos = i;
+    for ( ; 0 <= ( i = pdir_slotat( pos ) ); ++pos )
     {
-        next = qp->next;
-        mbuf_free( &qp );
+        size_t nlen = ROUNDUP8( strlen( ci[i].name ) + 1 );
+
+        if ( 0 != plen && 0 != strnicmp( ci[i].name, prefix, plen ) )
+            break;
+        if ( CLT_AUTH_OK != c[i].st )
+            continue;
+        /* Keep room for a cursor pointing at this entry. */
+        if ( MSG_MAX_PAY_SIZE < used + 16 + 8 + nlen + 8 + nlen )
+        {
+            if ( 0 > last )
+                continue;   /* Absurdly long name, cannot be listed. */
+            mbuf_addattrib( pp, MSG_ATTR_CURSOR, strlen( ci[last].name ) + 1, ci[last].name );
+            break;
+        }
+        mbuf_addattrib( pp, MSG_ATTR_PEERID, 8, c[i].id );
+        mbuf_addattrib( pp, MSG_ATTR_PEERNAME, strlen( ci[i].name ) + 1, ci[i].name );
+        used += 16 + 8 + nlen;
+        last = i;
     }
-    memset( cp, 0, sizeof *cp );
-    cp->fd = -1;
-    cp->st = CLT_INVALID;
-    return 0;
 }
 
-static int accept_client( client_t *clients, int lfd, int *pmaxfd, fd_set *m_rfds )
+/* Get a reference to the first page of the unfiltered peer list,
+ * building it if necessary; call with dir_lock held. */
+static mshared_t *peerlist_get( const client_t *c )
 {
-    int i, fd;
-    struct sockaddr_in addr;
-    socklen_t addrlen = sizeof addr;
+    mshared_t *s, *exp = NULL;
+    mbuf_t *m = NULL;
 
-    /* Preliminarily accept the connection. */
-    fd = accept( lfd, (struct sockaddr *)&addr, &addrlen );
-    return_if( -1 == fd, -1, "accept() failed: %m.\n" );
-    DLOG( "Accepted connection %d from [%s:%hu].\n",
-            fd, inet_ntoa( addr.sin_addr ), addr.sin_port );
-    if ( (int)FD_SETSIZE <= fd )
+    if ( NULL != ( s = __atomic_load_n( &peerlist_cache, __ATOMIC_ACQUIRE ) ) )
+        return mshared_ref( s );
+    mbuf_new( &m );
+    peerlist_page( &m, c, NULL, NULL );
+    s = mshared_new( m->b + MSG_HDR_SIZE, m->bsize - MSG_HDR_SIZE );
+    mbuf_free( &m );
+    /* Publish, unless another shard beat us to it. */
+    if ( !__atomic_compare_exchange_n( &peerlist_cache, &exp, s, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
     {
-        XLOG( LOG_ERR, "FD_SETSIZE exceeded, dropping connection %d.\n", fd );
-        close( fd );
-        return -1;
+        mshared_unref( &s );
+        s = exp;
     }
-    if ( 0 != set_nonblocking( fd ) )
+    return mshared_ref( s );
+}
+
+static int handoff_msg( client_t *c, int i_dst, mbuf_t *m, shard_t *sh );
+static int client_arm_send( client_t *cp, shard_t *sh );
+static void ctl_splice( client_t *cp );
+static int client_arm_recv( client_t *cp, shard_t *sh );
+static void wake_shard( shard_t *sh );
+static ctl_job_t *ctl_new( client_t *c, int i, shard_t *sh );
+static void ctl_submit( ctl_job_t *job, shard_t *sh );
+static int ctl_finish( client_t *c, ctl_job_t *job, shard_t *sh );
+
+/* Add or remove a slot to or from the presence subscribers; call with
+ * dir_lock held for writing. */
+static void presence_subscribe( int i, int on )
+{
+    if ( on && 0 > subpos[i] )
     {
-        XLOG( LOG_ERR, "set_nonblocking() failed, dropping connection %d.\n", fd );
-        close( fd );
-        return -1;
+        subpos[i] = nsubs;
+        subs[nsubs++] = i;
     }
-    /* Find an unused client slot. */
-    for ( i = 0; i < cfg.max_clients && 0 <= clients[i].fd; ++i )
-        continue;
-    if ( i == cfg.max_clients )
+    else if ( !on && 0 <= subpos[i] )
     {
-        XLOG( LOG_ERR, "No client slot available, dropping connection %d.\n", fd );
-        close( fd );
-        return -1;
+        int last = subs[--nsubs];
+        subs[subpos[i]] = last;
+        subpos[last] = subpos[i];
+        subpos[i] = -1;
     }
-    /* Ultimately adopt connection. */
-    clients[i].fd = fd;
-    clients[i].addrlen = addrlen;
-    clients[i].addr = addr;
-    clients[i].id = 0ULL;   /* Set upon login. */
-    clients[i].name = NULL; /* Set upon login. */
-    clients[i].key = NULL;  /* Set upon login. */
-    clients[i].st = CLT_PRE_LOGIN;
-    clients[i].act = time( NULL );
-    clients[i].rbuf = NULL;
-    clients[i].qhead = NULL;
-    clients[i].qtail = NULL;
-    FD_SET( fd, m_rfds );
-    if ( fd > *pmaxfd )
-        *pmaxfd = fd;
-    return i;
 }
 
-static int resync_client( client_t *cp, time_t now )
+/* Push collected presence changes to all subscribers as a single
+ * shared indication payload; call with dir_lock held for writing. */
+static void presence_flush( client_t *c, shard_t *sh )
 {
-    /* Detect message timeouts (gaps). */
-    if ( NULL != cp->rbuf && now - cp->act > cfg.msg_timeout )
+    mbuf_t *m = presence;
+    mshared_t *s;
+
+    if ( NULL == m )
+        return;
+    __atomic_store_n( &presence, NULL, __ATOMIC_RELAXED );
+    s = mshared_new( m->b + MSG_HDR_SIZE, m->bsize - MSG_HDR_SIZE );
+    mbuf_free( &m );
+    for ( int k = 0; k < nsubs; ++k )
     {
-        DLOG( "Intra-message gap detected, resynching.\n" );
-        mbuf_free( &cp->rbuf );
-        return 1;
+        int i = subs[k];
+        mbuf_compose( &m, MSG_TYPE_PEERLIST_IND, 0, c[i].id, 0 );
+        mbuf_attach( &m, s );
+        handoff_msg( c, i, m, sh );
+        m = NULL;
     }
-    return 0;
+    mshared_unref( &s );
+}
+
+/* Collect a presence change; call with dir_lock held for writing. */
+static void presence_note( client_t *c, enum MSG_ATTRIB at,
+                            uint64_t id, const char *name, shard_t *sh )
+{
+    mbuf_t *m;
+    size_t need = 8 + 8 + 8 + ROUNDUP8( strlen( name ) + 1 );
+
+    if ( 0 == nsubs )
+        return;
+    if ( NULL != presence && MSG_MAX_SIZE < presence->bsize + need )
+        presence_flush( c, sh );
+    if ( NULL == ( m = presence ) )
+        mbuf_new( &m );
+    mbuf_addattrib( &m, at, 8, id );
+    mbuf_addattrib( &m, MSG_ATTR_PEERNAME, strlen( name ) + 1, name );
+    __atomic_store_n( &presence, m, __ATOMIC_RELAXED );
 }
 
-static int upkeep( client_t *c, int *maxfd, fd_set *m_rfds, fd_set *m_wfds )
+/* Account for a peer that reached CLT_AUTH_OK; call with dir_lock held
+ * for writing. */
+static void peer_joined( client_t *c, int i, shard_t *sh )
 {
-    int i, j;
-    time_t now = time( NULL );
-    int x = 0, base = 0, top = 0;
+    peerlist_invalidate();
+    presence_note( c, MSG_ATTR_PEERID, c[i].id, sh->ci[i].name, sh );
+}
+
+/* Account for an authenticated peer going away; call with dir_lock held
+ * for writing, after removing it from the directory. */
+static void peer_gone( client_t *c, int i, shard_t *sh )
+{
+    presence_subscribe( i, 0 );
+    peerlist_invalidate();
+    for ( int j = pdir_byid( c[i].id, -1 ); 0 <= j; j = pdir_byid( c[i].id, j ) )
+        if ( CLT_AUTH_OK == c[j].st )
+            return;     /* Still represented by another session. */
+    presence_note( c, MSG_ATTR_PEERGONE, c[i].id, sh->ci[i].name, sh );
+}
 
-    for ( i = j = 0; i < cfg.max_clients; ++i )
+/* Dispose of a flow both ends have let go of. */
+static void flow_release( flow_t *f )
+{
+    if ( 0 > f->src && 0 > f->dst )
     {
-        if ( 0 <= c[i].fd )
-        {
-            if ( now - c[i].act > cfg.conn_timeout )
-            {   /* Dispose of timed out clients. */
-                close_client( &c[i], m_rfds, m_wfds );
-                ++x;
-            }
-            else
-                resync_client( &c[i], now );
-        }
-        if ( 0 <= c[i].fd )
-        {   /* Client still valid: adjust maxfd and budge up. */
-            if ( *maxfd < c[i].fd )
-                *maxfd = c[i].fd;
-            top = i;
-            base = j;
-            if ( j != i )
-            {
-                c[j] = c[i];
-                c[i].fd = -1;
-                c[i].st = CLT_INVALID;
-            }
-            ++j;
-        }
+        mbuf_free( &f->buf );
+        spipe_free( &f->pipe );
+        free( f );
     }
-    if ( x )
-        DLOG( "Closed %d expired connection(s).\n", x );
-    if ( top - base )
-        DLOG( "Compacted client list by %d.\n", top - base );
-    return 0;
 }
 
+/* Number of bytes held by a flow, waiting to be passed on. */
+static size_t flow_pending( const flow_t *f )
+{
+    return ( NULL != f->buf ? f->buf->boff - f->sent : 0 )
+            + ( NULL != f->pipe ? spipe_len( f->pipe ) : 0 );
+}
 
-/**********************************************
- * MESSAGE PROCESSING
- *
- */
-
-static int enqueue_msg( client_t *cp, mbuf_t *m, fd_set *m_wfds )
+/* Tell whether there is anything to send to a client right now; while
+ * a flow is under way, only its data is to be sent. */
+static int client_has_output( const client_t *cp )
 {
-    DLOG( "%p\n", m );
-    m->boff = 0;
-    m->next = NULL;
-    if ( NULL != cp->qtail )
-        cp->qtail->next = m;
-    cp->qtail = m;
-    if ( NULL == cp->qhead )
-        cp->qhead = m;
-    FD_SET( cp->fd, m_wfds );
-    return 0;
+    return NULL != cp->txflow ? 0 < flow_pending( cp->txflow ) : NULL != cp->qhead;
 }
 
-static int dequeue_msg( client_t *cp, fd_set *m_wfds )
+/* Put a client in the shard's output ring, unless already there. */
+static void sched_add( client_t *cp, shard_t *sh )
 {
-    mbuf_t *next;
+    int i = (int)( cp - sh->c );
 
-    DLOG( "dump:\n" );
-    mbuf_dump( cp->qhead );
+    if ( sh->ci[i].sched )
+        return;
+    sh->ci[i].sched = 1;
+    sh->ci[i].snext = -1;
+    sh->ci[i].sprev = sh->rlast;
+    if ( 0 <= sh->rlast )
+        sh->ci[sh->rlast].snext = i;
+    else
+        sh->rfirst = i;
+    sh->rlast = i;
+    ++sh->nready;
+}
 
-    next = cp->qhead->next;
-    if ( cp->qtail == cp->qhead )
-        cp->qtail = NULL;
-    mbuf_free( &cp->qhead );
-    cp->qhead = next;
-    if ( NULL == cp->qhead )
-        FD_CLR( cp->fd, m_wfds );
-    return 0;
+/* Take a client out of the shard's output ring. */
+static void sched_del( client_t *cp, shard_t *sh )
+{
+    client_info_t *ci = &sh->ci[cp - sh->c];
+
+    if ( !ci->sched )
+        return;
+    if ( 0 <= ci->sprev )
+        sh->ci[ci->sprev].snext = ci->snext;
+    else
+        sh->rfirst = ci->snext;
+    if ( 0 <= ci->snext )
+        sh->ci[ci->snext].sprev = ci->sprev;
+    else
+        sh->rlast = ci->sprev;
+    --sh->nready;
+    ci->sched = 0;
 }
 
-static int process_server_msg( client_t *c, int i_src, fd_set *m_rfds, fd_set *m_wfds )
+/* Take a client off the shard's stalled list. */
+static void unstall( client_t *cp, shard_t *sh )
 {
-    uint16_t mtype = HDR_GET_TYPE( c[i_src].rbuf );
-    enum MSG_ATTRIB at;
-    size_t al;
-    void *av;
-    const udb_t *pu;
+    int i = (int)( cp - sh->c );
 
-    if ( CLT_AUTH_OK != c[i_src].st
-        && MSG_TYPE_LOGIN_REQ != mtype
-        && MSG_TYPE_AUTH_REQ != mtype
-        && MSG_TYPE_REGISTER_REQ != mtype )
+    if ( 0 > sh->ci[i].stall )
+        return;
+    sh->ci[i].stall = -1;
+    for ( int k = 0; k < sh->nstalled; ++k )
     {
-        mbuf_to_error_response( &c[i_src].rbuf, SC_FORBIDDEN );
-        return -1;
+        if ( sh->stalled[k] == i )
+        {
+            sh->stalled[k] = sh->stalled[sh->nstalled - 1];
+            __atomic_store_n( &sh->nstalled, sh->nstalled - 1, __ATOMIC_RELAXED );
+            break;
+        }
     }
-    mbuf_resetgetattrib( c[i_src].rbuf );
-    switch ( mtype )
-    {
-    case MSG_TYPE_PING_IND:
-        /* Nothing to be done - client activity already recorded. */
-        mbuf_free( &c[i_src].rbuf );
-        break;
+}
+
+/* Account for bytes added to, or taken off, a client's send queue. Once
+ * the queue, or the total, drains to its low watermark, the other shards
+ * are woken up to resume the sources they stalled. */
+static void queue_account( client_t *cp, ssize_t n, shard_t *sh )
+{
+    client_info_t *ci = &sh->ci[cp - sh->c];
+    size_t q = ci->qbytes + n, total;
+    int wake = 0;
+
+    __atomic_store_n( &ci->qbytes, q, __ATOMIC_RELAXED );
+    total = __atomic_add_fetch( &relay_bytes, (size_t)n, __ATOMIC_RELAXED );
+    if ( 0 <= n )
+        return;
+    if ( q <= (size_t)cfg.queue_low )
+        wake |= __atomic_exchange_n( &ci->choked, 0, __ATOMIC_RELAXED );
+    if ( total <= (size_t)cfg.relay_budget / 4 * 3 )
+        wake |= __atomic_exchange_n( &relay_choked, 0, __ATOMIC_RELAXED );
+    if ( wake )
+        for ( int k = 0; k < nshards; ++k )
+            if ( &shards[k] != sh )
+                wake_shard( &shards[k] );
+}
+
+/* Tell whether the client in slot i is not to be fed for now, as its
+ * queue, or the total, is above the high watermark. */
+static int queue_full( int i, const shard_t *sh )
+{
+    return __atomic_load_n( &sh->ci[i].qbytes, __ATOMIC_RELAXED ) > (size_t)cfg.queue_high
+        || ( 0 < cfg.relay_budget
+            && __atomic_load_n( &relay_bytes, __ATOMIC_RELAXED ) > (size_t)cfg.relay_budget );
+}
+
+/* Stop reading from client i_src while the client i_dst it just sent
+ * a message to cannot take more. */
+static void throttle( client_t *c, int i_src, int i_dst, shard_t *sh )
+{
+    client_info_t *ci = &sh->ci[i_src];
+
+    if ( 0 <= ci->stall || !queue_full( i_dst, sh ) )
+        return;
+    DLOG( "Stalling c[%d] for c[%d].\n", i_src, i_dst );
+    ci->stall = i_dst;
+    ci->stall_id = __atomic_load_n( &c[i_dst].id, __ATOMIC_RELAXED );
+    __atomic_store_n( &sh->ci[i_dst].choked, 1, __ATOMIC_RELAXED );
+    if ( 0 < cfg.relay_budget )
+        __atomic_store_n( &relay_choked, 1, __ATOMIC_RELAXED );
+    sh->stalled[sh->nstalled] = i_src;
+    __atomic_store_n( &sh->nstalled, sh->nstalled + 1, __ATOMIC_RELAXED );
+    __atomic_add_fetch( &relay_stalls, 1, __ATOMIC_RELAXED );
+    client_arm_send( &c[i_src], sh );
+}
+
+/* Resume reading from stalled clients whose destination has drained to
+ * the low watermark, or gone away, while the total is low enough as well.
+ * Clients stalled are exempt from timeouts. Returns the number of clients
+ * still stalled. */
+static int unthrottle( client_t *c, shard_t *sh, time_t now )
+{
+    int relay_low = 0 == cfg.relay_budget
+        || __atomic_load_n( &relay_bytes, __ATOMIC_RELAXED ) <= (size_t)cfg.relay_budget / 4 * 3;
+
+    for ( int k = 0; k < sh->nstalled; )
+    {
+        int i = sh->stalled[k], d = sh->ci[i].stall;
+
+        if ( __atomic_load_n( &c[d].id, __ATOMIC_RELAXED ) == sh->ci[i].stall_id
+            && ( !relay_low || __atomic_load_n( &sh->ci[d].qbytes, __ATOMIC_RELAXED )
+                                > (size_t)cfg.queue_low ) )
+        {
+            c[i].act = now;
+            ++k;
+            continue;
+        }
+        DLOG( "Resuming c[%d].\n", i );
+        unstall( &c[i], sh );
+        client_arm_send( &c[i], sh );
+        client_arm_recv( &c[i], sh );
+    }
+    return sh->nstalled;
+}
+
+/* Release the buffers of zero-copy sends up to number done off the head
+ * of a list, returning the new head. */
+static mbuf_t *zc_release( mbuf_t *m, uint32_t done )
+{
+    while ( NULL != m && 0 <= (int32_t)( done - m->boff ) )
+    {
+        mbuf_t *next = m->next;
+
+        mbuf_free( &m );
+        m = next;
+    }
+    return m;
+}
+
+/* Keep the socket of a closing client open, shut down for writing, with
+ * the buffers of its zero-copy sends still in flight, until the kernel
+ * is done with them. */
+static void zc_bury( client_t *cp, shard_t *sh )
+{
+    client_info_t *ci = &sh->ci[cp - sh->c];
+    zc_grave_t *g = malloc_s( sizeof *g );
+
+    DLOG( "Keeping c[%d] open for %u zero-copy send(s) in flight.\n",
+            (int)( cp - sh->c ), (unsigned)( ci->zc_seq - ci->zc_done ) );
+    shutdown( cp->fd, SHUT_WR );
+    g->fd = cp->fd;
+    g->done = ci->zc_done;
+    g->head = ci->zc_head;
+    g->since = MONOTIME();
+    g->next = sh->graves;
+    sh->graves = g;
+    ci->zc_head = ci->zc_tail = NULL;
+}
+
+/* Collect zero-copy send completions for closed connections, and close
+ * those done with, or waited for long enough; the latter are reset, so
+ * the kernel discards what was not sent. */
+static void zc_reap_graves( shard_t *sh, time_t now )
+{
+    zc_grave_t **pg = &sh->graves, *g;
+
+    while ( NULL != ( g = *pg ) )
+    {
+        int copied = 0, r;
+
+        if ( 0 > ( r = zcopy_reap( g->fd, &g->done, &copied ) ) )
+            XLOG( LOG_ERR, "zcopy_reap() failed: %m.\n" );
+        else
+            g->head = zc_release( g->head, g->done );
+        if ( 0 <= r && NULL != g->head && now - g->since <= ZC_LINGER_S )
+        {
+            pg = &g->next;
+            continue;
+        }
+        if ( NULL != g->head )
+        {
+            struct linger lg = { 1, 0 };
+
+            XLOG( LOG_WARNING, "Zero-copy sends not completed, resetting connection.\n" );
+            setsockopt( g->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof lg );
+            for ( mbuf_t *m = g->head, *next; NULL != m; m = next )
+            {
+                next = m->next;
+                mbuf_free( &m );
+            }
+        }
+        close( g->fd );
+        *pg = g->next;
+        free( g );
+    }
+}
+
+static int close_client( client_t *cp, shard_t *sh )
+{
+    int i = (int)( cp - sh->c ), last;
+    flow_t *f;
+
+    DLOG( "Closing connection to [%s:%hu].\n",
+        inet_ntoa( sh->ci[i].addr.sin_addr ), sh->ci[i].addr.sin_port );
+    poller_del( sh->pl, cp->fd );
+    twheel_del( sh->tw, i - sh->lo );
+    if ( NULL != sh->ci[i].zc_head )
+        zc_bury( cp, sh );
+    else
+        close( cp->fd );
+    mbuf_free( &cp->rbuf );
+    if ( NULL != ( f = cp->txflow ) )
+    {   /* The source drops the rest of the message. */
+        int src = f->src;
+
+        f->dst = -1;
+        if ( f->full && 0 <= src )
+        {
+            f->full = 0;
+            client_arm_send( &sh->c[src], sh );
+        }
+        flow_release( f );
+    }
+    if ( NULL != ( f = cp->rxflow ) )
+    {   /* Abort the message. Unless none of it has been passed on yet,
+         * the destination cannot recover from the truncated message. */
+        int dst = f->dst, clean = 0 == f->sent;
+
+        if ( 0 <= dst && clean )
+        {
+            sh->c[dst].txflow = NULL;
+            queue_account( &sh->c[dst], -(ssize_t)f->size, sh );
+        }
+        f->src = -1;
+        f->dst = clean ? -1 : dst;
+        flow_release( f );
+        if ( 0 <= dst )
+        {
+            if ( clean )
+                client_arm_send( &sh->c[dst], sh );
+            else
+                close_client( &sh->c[dst], sh );
+        }
+    }
+    for ( mbuf_t *qp = cp->qhead, *next; NULL != qp; qp = next )
+    {
+        next = qp->next;
+        mbuf_free( &qp );
+    }
+    for ( mbuf_t *qp = cp->chead, *next; NULL != qp; qp = next )
+    {
+        next = qp->next;
+        mbuf_free( &qp );
+    }
+    cp->chead = cp->ctail = NULL;
+    while ( NULL != cp->sq )
+    {
+        subq_t *q = cp->sq->next;
+
+        cp->sq->next = q->next;
+        if ( q == cp->sq )
+            cp->sq = NULL;
+        for ( mbuf_t *qp = q->head, *next; NULL != qp; qp = next )
+        {
+            next = qp->next;
+            mbuf_free( &qp );
+        }
+        free( q );
+    }
+    sched_del( cp, sh );
+    unstall( cp, sh );
+    queue_account( cp, -(ssize_t)sh->ci[i].qbytes, sh );
+    DIR_WRLOCK();
+    pdir_del( i );
+    if ( CLT_AUTH_OK == cp->st )
+        peer_gone( sh->c, i, sh );
+    free( sh->ci[i].name );
+    free( sh->ci[i].key );
+    free( sh->ci[i].held );
+    memset( &sh->ci[i], 0, sizeof sh->ci[i] );
+    memset( cp, 0, sizeof *cp );
+    cp->fd = -1;
+    cp->st = CLT_INVALID;
+    /* Move the last active slot into the gap, and release ours. */
+    last = sh->active[sh->nactive - 1];
+    sh->active[sh->apos[i - sh->lo]] = last;
+    sh->apos[last - sh->lo] = sh->apos[i - sh->lo];
+    __atomic_store_n( &sh->nactive, sh->nactive - 1, __ATOMIC_RELAXED );
+    sh->freeslot[sh->nfree++] = i;
+    DIR_UNLOCK();
+    return 0;
+}
+
+/* Signal a shard that work has been handed over to it. */
+static void wake_shard( shard_t *sh )
+{
+    if ( 1 != write( sh->wake[1], "", 1 ) && EAGAIN != errno && EWOULDBLOCK != errno )
+        XLOG( LOG_ERR, "write() to wakeup pipe failed: %m.\n" );
+}
+
+/* Append a request to a shard's command list. */
+static int post_cmd( shard_t *sh, const shard_cmd_t *cmd )
+{
+    pthread_mutex_lock( &sh->cmd_lock );
+    if ( sh->ncmd == sh->cmd_sz )
+    {
+        sh->cmd_sz = sh->cmd_sz ? sh->cmd_sz * 2 : 8;
+        sh->cmd = realloc_s( sh->cmd, sh->cmd_sz * sizeof *sh->cmd );
+    }
+    sh->cmd[sh->ncmd++] = *cmd;
+    pthread_mutex_unlock( &sh->cmd_lock );
+    wake_shard( sh );
+    return 0;
+}
+
+/* Ask the owning shard to close a client, unless it changed identity
+ * in the meantime. */
+static int kick_client( int i, uint64_t id )
+{
+    shard_cmd_t cmd;
+
+    memset( &cmd, 0, sizeof cmd );
+    cmd.cmd = CMD_KICK;
+    cmd.arg = i;
+    cmd.id = id;
+    return post_cmd( &shards[i / shard_size], &cmd );
+}
+
+/* Submit a receive into the client's buffer; asynchronous backends only. */
+static int client_arm_recv( client_t *cp, shard_t *sh )
+{
+    if ( !poller_is_async( sh->pl ) || 0 > cp->fd
+        || 0 <= sh->ci[cp - sh->c].stall || sh->ci[cp - sh->c].ctl )
+        return 0;
+    if ( NULL == cp->rbuf )
+        mbuf_new( &cp->rbuf );
+    if ( 0 != poller_recv( sh->pl, cp->fd, cp->rbuf->b + cp->rbuf->boff,
+                            cp->rbuf->bsize - cp->rbuf->boff )
+        && EBUSY != errno )
+    {
+        XLOG( LOG_ERR, "poller_recv() failed: %m.\n" );
+        return -1;
+    }
+    return 0;
+}
+
+/* Request output for the client's send queue, if any, and input
+ * unless stalled or waiting for the control plane. */
+static int client_arm_send( client_t *cp, shard_t *sh )
+{
+    struct iovec iov[POLLER_IOV_MAX];
+    size_t len;
+    int n;
+
+    if ( !poller_is_async( sh->pl ) )
+        return poller_set( sh->pl, cp->fd,
+                           ( 0 > sh->ci[cp - sh->c].stall && !sh->ci[cp - sh->c].ctl
+                             && ( NULL == cp->rxflow || !cp->rxflow->full )
+                             ? POLLER_IN : 0 )
+                           | ( client_has_output( cp ) ? POLLER_OUT : 0 ) );
+    /* The poller forgets about a send once it completes, before the
+     * completion is handled; until then, the data it covered is still
+     * at the head of the queue, and must not be submitted again. */
+    if ( NULL == cp->qhead || 0 < sh->ci[cp - sh->c].sending )
+        return 0;
+    ctl_splice( cp );
+    n = mbuf_iovec( cp->qhead, iov, POLLER_IOV_MAX, MBUF_IOV_BUDGET, &len );
+    if ( 0 != poller_sendv( sh->pl, cp->fd, iov, n, 0 ) )
+    {
+        if ( EBUSY == errno )
+            return 0;
+        XLOG( LOG_ERR, "poller_sendv() failed: %m.\n" );
+        return -1;
+    }
+    sh->ci[cp - sh->c].sending = len;
+    return 0;
+}
+
+/* Time the oldest message queued for a client was queued, 0 if none. */
+static time_t queue_oldest( const client_t *cp )
+{
+    time_t t = 0;
+    const subq_t *q = cp->sq;
+
+    for ( const mbuf_t *m = cp->qhead; NULL != m; m = m->next )
+        if ( 0 == t || m->qtime < t )
+            t = m->qtime;
+    if ( NULL != cp->chead && ( 0 == t || cp->chead->qtime < t ) )
+        t = cp->chead->qtime;
+    if ( NULL != q )
+    {
+        do
+        {
+            if ( NULL != q->head && ( 0 == t || q->head->qtime < t ) )
+                t = q->head->qtime;
+            q = q->next;
+        }
+        while ( q != cp->sq );
+    }
+    return t;
+}
+
+/* Tell whether a client holding more than a second's worth of data at
+ * the configured minimum rate has, over at least the rate window, been
+ * draining its queue slower than that. */
+static int drains_slowly( const client_info_t *ci, time_t now )
+{
+    return 0 < cfg.queue_min_rate && ci->qbytes > (size_t)cfg.queue_min_rate
+        && now - ci->dsince >= QUEUE_RATE_WINDOW_S
+        && ci->drained / (size_t)( now - ci->dsince ) < (size_t)cfg.queue_min_rate;
+}
+
+/* Return when to check a client's drain rate next, or 0 if not due. */
+static time_t drain_check_due( const client_info_t *ci, time_t now )
+{
+    if ( 0 >= cfg.queue_min_rate || ci->qbytes <= (size_t)cfg.queue_min_rate )
+        return 0;
+    return ci->dsince + QUEUE_RATE_WINDOW_S > now
+        ? ci->dsince + QUEUE_RATE_WINDOW_S : now + 1;
+}
+
+/* Tell whether a client falls behind the messages queued for it beyond
+ * the configured limits. */
+static int slow_consumer( const client_t *cp, const shard_t *sh, time_t now )
+{
+    time_t t;
+
+    return drains_slowly( &sh->ci[cp - sh->c], now )
+        || ( 0 < cfg.queue_max_bytes
+             && sh->ci[cp - sh->c].qbytes > (size_t)cfg.queue_max_bytes )
+        || ( 0 < cfg.queue_max_age && 0 != ( t = queue_oldest( cp ) )
+             && now - t > cfg.queue_max_age );
+}
+
+/* Arm the client's timer for the earliest of its pending deadlines. */
+static int client_arm_timer( client_t *cp, shard_t *sh )
+{
+    time_t due = cp->act + cfg.conn_timeout + 1, t;
+
+    if ( ( NULL != cp->rxflow || ( NULL != cp->rbuf && 0 < cp->rbuf->boff ) )
+        && cp->act + cfg.msg_timeout + 1 < due )
+        due = cp->act + cfg.msg_timeout + 1;
+    if ( 0 < cfg.queue_max_age && 0 != ( t = queue_oldest( cp ) )
+        && t + cfg.queue_max_age + 1 < due )
+        due = t + cfg.queue_max_age + 1;
+    if ( 0 < cfg.queue_max_bytes
+        && sh->ci[cp - sh->c].qbytes > (size_t)cfg.queue_max_bytes )
+        due = MONOTIME();
+    if ( 0 != ( t = drain_check_due( &sh->ci[cp - sh->c], MONOTIME() ) ) && t < due )
+        due = t;
+    return twheel_set( sh->tw, (int)( cp - sh->c ) - sh->lo, due );
+}
+
+static int adopt_client( client_t *clients, int fd,
+                    const struct sockaddr_in *addr, socklen_t addrlen, shard_t *sh )
+{
+    int i;
+
+    /* Grab an unused client slot. */
+    if ( 0 == sh->nfree )
+    {
+        XLOG( LOG_ERR, "No client slot available, dropping connection %d.\n", fd );
+        close( fd );
+        return -1;
+    }
+    i = sh->freeslot[sh->nfree - 1];
+    if ( 0 != poller_add( sh->pl, fd, i, poller_is_async( sh->pl ) ? 0 : POLLER_IN ) )
+    {
+        XLOG( LOG_ERR, "poller_add() failed: %m, dropping connection %d.\n", fd );
+        close( fd );
+        return -1;
+    }
+    /* Ultimately adopt connection. */
+    clients[i].fd = fd;
+    clients[i].id = 0ULL;   /* Set upon login. */
+    sh->ci[i].addrlen = addrlen;
+    sh->ci[i].addr = *addr;
+    sh->ci[i].name = NULL;  /* Set upon login. */
+    sh->ci[i].key = NULL;   /* Set upon login. */
+    sh->ci[i].bulk = 0;
+    sh->ci[i].zc = 0;
+    if ( 0 < cfg.zerocopy_min && !poller_is_async( sh->pl ) )
+    {
+        if ( 0 == zcopy_enable( fd ) )
+            sh->ci[i].zc = 1;
+        else
+            DLOG( "zcopy_enable() failed: %m.\n" );
+    }
+    sh->ci[i].zc_seq = sh->ci[i].zc_done = 0;
+    sh->ci[i].zc_head = sh->ci[i].zc_tail = NULL;
+    sh->ci[i].sched = 0;
+    sh->ci[i].deficit = 0;
+    sh->ci[i].qbytes = 0;
+    sh->ci[i].choked = 0;
+    sh->ci[i].stall = -1;
+    sh->ci[i].conn = ++sh->nconn;
+    sh->ci[i].ctl = 0;
+    sh->ci[i].held = NULL;
+    sh->ci[i].nheld = 0;
+    DIR_WRLOCK();
+    clients[i].st = CLT_PRE_LOGIN;
+    --sh->nfree;
+    sh->apos[i - sh->lo] = sh->nactive;
+    sh->active[sh->nactive] = i;
+    __atomic_store_n( &sh->nactive, sh->nactive + 1, __ATOMIC_RELAXED );
+    DIR_UNLOCK();
+    clients[i].act = MONOTIME();
+    clients[i].rbuf = NULL;
+    clients[i].qhead = NULL;
+    clients[i].qtail = NULL;
+    clients[i].qctl = NULL;
+    clients[i].chead = NULL;
+    clients[i].ctail = NULL;
+    clients[i].qflows = 0;
+    clients[i].sq = NULL;
+    clients[i].rxflow = NULL;
+    clients[i].txflow = NULL;
+    client_arm_timer( &clients[i], sh );
+    if ( 0 != client_arm_recv( &clients[i], sh ) )
+    {
+        close_client( &clients[i], sh );
+        return -1;
+    }
+    return i;
+}
+
+/* Tell whether the relay is too busy to take on new sessions: either
+ * a reactor falls behind with its events, or too much data is queued. */
+static int overloaded( void )
+{
+    if ( 0 < cfg.admit_max_queued
+        && __atomic_load_n( &relay_bytes, __ATOMIC_RELAXED ) > (size_t)cfg.admit_max_queued )
+        return 1;
+    if ( 0 < cfg.admit_max_lag )
+        for ( int k = 0; k < nshards; ++k )
+            if ( __atomic_load_n( &shards[k].lag, __ATOMIC_RELAXED )
+                    > ntime_from_ms( cfg.admit_max_lag ) )
+                return 1;
+    return 0;
+}
+
+/* Stop, or resume, watching the listening socket; connections arriving
+ * in the meantime wait in the kernel's backlog. */
+static int accept_pause( shard_t *sh, int on )
+{
+    if ( sh->paused == on )
+        return 0;
+    if ( on )
+    {
+        DLOG( "Overload, deferring accepts.\n" );
+        __atomic_add_fetch( &admit_pauses, 1, __ATOMIC_RELAXED );
+    }
+    sh->paused = on;
+    return poller_set( sh->pl, sh->lfd, on ? 0 : POLLER_IN );
+}
+
+static int accept_client( client_t *clients, int lfd, shard_t *sh )
+{
+    int fd;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof addr;
+    shard_cmd_t cmd;
+
+    /* Preliminarily accept the connection. */
+    fd = accept( lfd, (struct sockaddr *)&addr, &addrlen );
+    if ( -1 == fd && ( EAGAIN == errno || EWOULDBLOCK == errno ) )
+        return -1;
+    return_if( -1 == fd, -1, "accept() failed: %m.\n" );
+    DLOG( "Accepted connection %d from [%s:%hu].\n",
+            fd, inet_ntoa( addr.sin_addr ), addr.sin_port );
+    /* Asynchronous backends wait in the kernel instead. */
+    if ( !poller_is_async( sh->pl ) && 0 != set_nonblocking( fd ) )
+    {
+        XLOG( LOG_ERR, "set_nonblocking() failed, dropping connection %d.\n", fd );
+        close( fd );
+        return -1;
+    }
+    if ( 0 < sh->nfree )
+        return adopt_client( clients, fd, &addr, addrlen, sh );
+    /* Pass the connection on to a shard with spare capacity, if any. */
+    for ( int k = 0; k < nshards; ++k )
+    {
+        if ( __atomic_load_n( &shards[k].nactive, __ATOMIC_RELAXED )
+                < shards[k].hi - shards[k].lo )
+        {
+            memset( &cmd, 0, sizeof cmd );
+            cmd.cmd = CMD_ADOPT;
+            cmd.arg = fd;
+            cmd.addrlen = addrlen;
+            cmd.addr = addr;
+            return post_cmd( &shards[k], &cmd );
+        }
+    }
+    XLOG( LOG_ERR, "No client slot available, dropping connection %d.\n", fd );
+    close( fd );
+    return -1;
+}
+
+/* Let the source of a file transfer message that is not going to be
+ * delivered to client i know, unless already notified as listed in the
+ * first n entries of done[]; returns the new count. */
+static int report_undelivered( client_t *c, int i, const mbuf_t *m,
+                               uint64_t (*done)[2], int n, shard_t *sh )
+{
+    uint64_t src = HDR_GET_SRCID( m ), oid = mbuf_offerid( m );
+    uint16_t mtype = HDR_GET_TYPE( m );
+    const char *errmsg = sc_msgstr( SC_GATEWAY_TIMEOUT );
+    mbuf_t *e = NULL;
+    int j;
+
+    if ( ( MSG_TYPE_GETFILE_REQ != mtype && MSG_TYPE_GETFILE_RES != mtype )
+        || 0ULL == src || src == c[i].id || EVICT_REPORT_MAX == n )
+        return n;
+    for ( j = 0; j < n; ++j )
+        if ( done[j][0] == src && done[j][1] == oid )
+            return n;
+    done[n][0] = src;
+    done[n][1] = oid;
+    if ( 0 > ( j = route_lookup( c, src ) ) )
+        return n + 1;
+    mbuf_compose( &e, MSG_TYPE_GETFILE_ERR, c[i].id, src, HDR_GET_TRFID( m ) );
+    if ( 0 != oid )
+        mbuf_addattrib( &e, MSG_ATTR_OFFERID, 8, oid );
+    mbuf_addattrib( &e, MSG_ATTR_ERROR, 8, (uint64_t)SC_GATEWAY_TIMEOUT );
+    mbuf_addattrib( &e, MSG_ATTR_NOTICE, strlen( errmsg ) + 1, errmsg );
+    handoff_msg( c, j, e, sh );
+    return n + 1;
+}
+
+/* Disconnect a client that does not keep up with its queue, reporting
+ * the file transfers queued for it failed to their sources. */
+static int evict_client( client_t *c, int i, shard_t *sh, time_t now )
+{
+    client_info_t *ci = &sh->ci[i];
+    uint64_t done[EVICT_REPORT_MAX][2];
+    time_t dt = now - ci->dsince;
+    int n = 0;
+
+    XLOG( LOG_WARNING, "Evicting slow client [%s:%hu]: %zu bytes queued,"
+            " oldest for %lds, draining %zu bytes/s.\n",
+            inet_ntoa( ci->addr.sin_addr ), ntohs( ci->addr.sin_port ), ci->qbytes,
+            (long)( now - queue_oldest( &c[i] ) ), ci->drained / ( 0 < dt ? dt : 1 ) );
+    for ( const mbuf_t *m = c[i].qhead; NULL != m; m = m->next )
+        n = report_undelivered( c, i, m, done, n, sh );
+    for ( const mbuf_t *m = c[i].chead; NULL != m; m = m->next )
+        n = report_undelivered( c, i, m, done, n, sh );
+    if ( NULL != c[i].sq )
+    {
+        const subq_t *q = c[i].sq;
+
+        do
+        {   /* One report covers the flow. */
+            if ( NULL != q->head )
+                n = report_undelivered( c, i, q->head, done, n, sh );
+            q = q->next;
+        }
+        while ( q != c[i].sq );
+    }
+    __atomic_add_fetch( &relay_evictions, 1, __ATOMIC_RELAXED );
+    return close_client( &c[i], sh );
+}
+
+static int resync_client( client_t *cp, time_t now, shard_t *sh )
+{
+    /* Detect message timeouts (gaps). */
+    if ( NULL != cp->rbuf && 0 < cp->rbuf->boff && now - cp->act > cfg.msg_timeout )
+    {
+        DLOG( "Intra-message gap detected, resynching.\n" );
+        /* Take the buffer back from the kernel before dropping it. */
+        if ( poller_is_async( sh->pl ) )
+            poller_cancel( sh->pl, cp->fd, POLLER_RECV );
+        mbuf_free( &cp->rbuf );
+        client_arm_recv( cp, sh );
+        return 1;
+    }
+    return 0;
+}
+
+static int upkeep( client_t *c, shard_t *sh, time_t now )
+{
+    int i, x = 0;
+
+    /* Only clients with expired timers are visited; activity does not
+     * touch the timers, so some may merely need to be re-armed. */
+    while ( 0 <= ( i = twheel_pop( sh->tw, now ) ) )
+    {
+        i += sh->lo;
+        if ( NULL != c[i].rxflow && c[i].rxflow->full )
+            c[i].act = now;     /* Waiting for the destination, as stalled. */
+        if ( now - c[i].act > cfg.conn_timeout
+            || ( NULL != c[i].rxflow && now - c[i].act > cfg.msg_timeout ) )
+        {   /* Dispose of timed out clients, and stalled flows. */
+            close_client( &c[i], sh );
+            ++x;
+        }
+        else if ( slow_consumer( &c[i], sh, now ) )
+        {
+            evict_client( c, i, sh, now );
+            ++x;
+        }
+        else
+        {
+            resync_client( &c[i], now, sh );
+            client_arm_timer( &c[i], sh );
+        }
+    }
+    if ( x )
+        DLOG( "Closed %d expired connection(s).\n", x );
+    return 0;
+}
+
+
+/**********************************************
+ * MESSAGE PROCESSING
+ *
+ */
+
+/* Release buffers of zero-copy sends the kernel is done with. Once the
+ * kernel resorts to copying, zero-copy sends are not worth it anymore. */
+static int client_zc_reap( client_t *cp, shard_t *sh )
+{
+    client_info_t *ci = &sh->ci[cp - sh->c];
+    int copied = 0;
+
+    if ( 0 > zcopy_reap( cp->fd, &ci->zc_done, &copied ) )
+    {
+        XLOG( LOG_ERR, "zcopy_reap() failed: %m.\n" );
+        return -1;
+    }
+    ci->zc_head = zc_release( ci->zc_head, ci->zc_done );
+    if ( NULL == ci->zc_head )
+        ci->zc_tail = NULL;
+    if ( copied && ci->zc )
+    {
+        DLOG( "Zero-copy sends to c[%d] fell back to copying.\n", (int)( cp - sh->c ) );
+        ci->zc = 0;
+    }
+    return 0;
+}
+
+/* Fetch and clear a pending socket error, once zero-copy completions
+ * have been collected. Returns 0 if there is none, or -1 with errno set
+ * to the error. */
+static int client_error( client_t *cp )
+{
+    int err = 0;
+    socklen_t len = sizeof err;
+
+    if ( 0 != getsockopt( cp->fd, SOL_SOCKET, SO_ERROR, &err, &len ) )
+        return -1;
+    return 0 != err ? ( errno = err, -1 ) : 0;
+}
+
+/* Turn the lifetime in milliseconds a message arrived with into a
+ * deadline on the monotonic clock; 0 for none. */
+static void ttl_start( mbuf_t *m, uint64_t ttl )
+{
+    if ( INT32_MAX < ttl )
+        ttl = INT32_MAX;    /* some 24 days */
+    m->expire = 0 != ttl ? nclock_get() + ntime_from_ms( ttl ) : 0;
+}
+
+/* Tell whether a message has outlived its TTL, counting it as dropped
+ * if so. */
+static int ttl_expired( const mbuf_t *m )
+{
+    unsigned k = MTYPE_CUT_CLASS( HDR_GET_TYPE( m ) ) >> 4;
+
+    if ( 0 == m->expire || m->expire > nclock_get() )
+        return 0;
+    DLOG( "Dropping expired %s message.\n", mtype2str( HDR_GET_TYPE( m ) ) );
+    __atomic_add_fetch( &ttl_drops[k < TTL_NTYPES ? k : 0], 1, __ATOMIC_RELAXED );
+    return 1;
+}
+
+/* Find the backlogged flow a message belongs to, if any. */
+static subq_t *subq_find( const client_t *cp, const mbuf_t *m )
+{
+    uint64_t src = HDR_GET_SRCID( m ), oid = mbuf_offerid( m );
+    subq_t *q = cp->sq;
+
+    if ( NULL != q )
+    {
+        do
+        {
+            if ( q->src == src && q->oid == oid )
+                return q;
+            q = q->next;
+        }
+        while ( q != cp->sq );
+    }
+    return NULL;
+}
+
+/* Queue a message for a backlogged client, in the queue q of its flow,
+ * or a new one if NULL. */
+static void subq_put( client_t *cp, subq_t *q, mbuf_t *m )
+{
+    if ( NULL != q )
+    {
+        q->tail->next = m;
+        q->tail = m;
+        return;
+    }
+    /* New flows join at the end of the ring. */
+    q = malloc_s( sizeof *q );
+    q->src = HDR_GET_SRCID( m );
+    q->oid = mbuf_offerid( m );
+    q->head = q->tail = m;
+    q->deficit = 0;
+    if ( NULL != cp->sq )
+    {
+        q->next = cp->sq->next;
+        cp->sq->next = q;
+    }
+    else
+        q->next = q;
+    cp->sq = q;
+}
+
+/* Bit standing for the flow of a message in a client's queued flows. */
+static uint64_t flow_bit( const mbuf_t *m )
+{
+    uint64_t h = HDR_GET_SRCID( m ) ^ mbuf_offerid( m ) * 0x9e3779b97f4a7c15ULL;
+
+    return 1ULL << ( h * 0xff51afd7ed558ccdULL >> 58 );
+}
+
+/* Put a control message for a busy client in the priority lane, to be
+ * moved to the send queue by ctl_splice() when the next send is built. */
+static void queue_urgent( client_t *cp, mbuf_t *m )
+{
+    if ( NULL != cp->ctail )
+        cp->ctail->next = m;
+    else
+        cp->chead = m;
+    cp->ctail = m;
+}
+
+/* Move pending control messages into the send queue, ahead of all data
+ * not being sent yet, but behind the partially sent head and control
+ * messages moved earlier. Only call while no send is in flight. */
+static void ctl_splice( client_t *cp )
+{
+    mbuf_t *p = cp->qctl;
+
+    if ( NULL == cp->chead )
+        return;
+    if ( NULL == p && NULL != cp->qhead && 0 < cp->qhead->boff )
+        p = cp->qhead;
+    if ( NULL != p )
+    {
+        cp->ctail->next = p->next;
+        p->next = cp->chead;
+    }
+    else
+    {
+        cp->ctail->next = cp->qhead;
+        cp->qhead = cp->chead;
+    }
+    if ( NULL == cp->ctail->next )
+        cp->qtail = cp->ctail;
+    cp->qctl = cp->ctail;
+    cp->chead = cp->ctail = NULL;
+}
+
+/* Refill the client's empty send queue from its backlogged flows, in
+ * deficit round robin order: on each visit, a flow's deficit grows by
+ * one quantum, and it may move as many messages as the deficit covers.
+ * Takes complete rounds, until at least one message was moved. */
+static void subq_pull( client_t *cp, shard_t *sh )
+{
+    int moved = 0;
+    subq_t *end = cp->sq;
+
+    while ( NULL != cp->sq )
+    {
+        subq_t *t = cp->sq, *q = t->next;
+        int last = q == end;
+        mbuf_t *m;
+
+        q->deficit += cfg.sched_quantum;
+        while ( NULL != ( m = q->head ) && m->bsize <= q->deficit )
+        {
+            q->head = m->next;
+            if ( ttl_expired( m ) )
+            {   /* Not worth sending anymore. */
+                queue_account( cp, -(ssize_t)m->bsize, sh );
+                mbuf_free( &m );
+                continue;
+            }
+            q->deficit -= m->bsize;
+            m->next = NULL;
+            cp->qflows |= flow_bit( m );
+            if ( NULL != cp->qtail )
+                cp->qtail->next = m;
+            else
+                cp->qhead = m;
+            cp->qtail = m;
+            ++moved;
+        }
+        if ( NULL == q->head )
+        {   /* Drained flows leave the ring, and forfeit their deficit. */
+            if ( q == t )
+                cp->sq = NULL;
+            else
+                t->next = q->next;
+            free( q );
+        }
+        else
+            cp->sq = q;
+        if ( last )
+        {
+            if ( moved )
+                break;
+            end = cp->sq;
+        }
+    }
+}
+
+/* Account for sent bytes, releasing all messages sent completely. While
+ * zero-copy sends are in flight, messages are kept until completion.
+ * Once the send queue is empty, it is refilled from backlogged flows. */
+static int dequeue_msg( client_t *cp, size_t sent, shard_t *sh )
+{
+    client_info_t *ci = &sh->ci[cp - sh->c];
+    mbuf_t *m;
+
+    ci->drained += sent;
+    while ( NULL != ( m = cp->qhead ) )
+    {
+        if ( m->bsize - m->boff > sent )
+        {   /* Partially sent, carry on later. */
+            m->boff += sent;
+            break;
+        }
+        sent -= m->bsize - m->boff;
+        queue_account( cp, -(ssize_t)m->bsize, sh );
+        DLOG( "dump:\n" );
+        mbuf_dump( m );
+        cp->qhead = m->next;
+        if ( cp->qtail == m )
+            cp->qtail = NULL;
+        if ( cp->qctl == m )
+            cp->qctl = NULL;
+        if ( ci->zc_seq == ci->zc_done )
+        {
+            mbuf_free( &m );
+            continue;
+        }
+        /* The offset is free for use after dequeuing. */
+        m->boff = ci->zc_seq;
+        m->next = NULL;
+        if ( NULL != ci->zc_tail )
+            ci->zc_tail->next = m;
+        else
+            ci->zc_head = m;
+        ci->zc_tail = m;
+    }
+    if ( NULL == cp->qhead )
+    {   /* Pending control messages go first, then backlogged flows. */
+        cp->qflows = 0;
+        ctl_splice( cp );
+        if ( NULL == cp->qhead && NULL != cp->sq )
+            subq_pull( cp, sh );
+    }
+    client_arm_send( cp, sh );
+    return 0;
+}
+
+/* Pass the data held by a flow on to the destination, and let go of
+ * the flow once the message is complete. Returns like write(). */
+static int flow_send( client_t *cp, shard_t *sh )
+{
+    flow_t *f = cp->txflow;
+    mbuf_t *m = f->buf;
+    int w = -1;
+
+    errno = EAGAIN;
+    if ( NULL != m && f->sent < m->boff )
+    {   /* Buffered data goes first, pushed out only once complete. */
+        int more = 0 < f->left || NULL != f->pipe;
+
+        if ( 0 < ( w = send( cp->fd, m->b + f->sent, m->boff - f->sent,
+                             more ? MSG_MORE : 0 ) ) )
+            f->sent += w;
+        if ( NULL != f->pipe && f->sent == m->boff )
+            mbuf_free( &f->buf );
+    }
+    else if ( NULL != f->pipe && 0 < spipe_len( f->pipe ) )
+        w = spipe_drain( f->pipe, cp->fd, 0 < f->left );
+    if ( 0 < w )
+        sh->ci[cp - sh->c].drained += w;
+    if ( 0 < w && f->full && 0 <= f->src )
+    {   /* Room in the pipe again, resume reading from the source. */
+        f->full = 0;
+        sh->c[f->src].act = MONOTIME();
+        client_arm_send( &sh->c[f->src], sh );
+    }
+    if ( 0 == f->left && 0 == flow_pending( f ) )
+    {
+        queue_account( cp, -(ssize_t)f->size, sh );
+        cp->txflow = NULL;
+        f->dst = -1;
+        flow_release( f );
+    }
+    client_arm_send( cp, sh );
+    return w;
+}
+
+/* Take the next part of a flow's message from the source, passing it
+ * on right away if possible. Once the destination is gone, the rest of
+ * the message is read and dropped. Returns like read(). */
+static int flow_recv( client_t *cp, shard_t *sh )
+{
+    flow_t *f = cp->rxflow;
+    int r;
+
+    if ( 0 > f->dst )
+        r = read( cp->fd, sh->rx, f->left < RX_BUF_SIZE ? f->left : RX_BUF_SIZE );
+    else if ( NULL != f->pipe )
+    {
+        if ( 0 > ( r = spipe_fill( f->pipe, cp->fd, f->left ) )
+            && EAGAIN == errno && 0 < spipe_len( f->pipe ) )
+        {   /* The source may well still be readable, but the pipe is
+             * full; stop watching the source until it drains. */
+            f->full = 1;
+            client_arm_send( cp, sh );
+        }
+    }
+    else if ( 0 < ( r = read( cp->fd, f->buf->b + f->buf->boff, f->left ) ) )
+        f->buf->boff += r;
+    if ( 0 >= r )
+        return r;
+    f->left -= r;
+    if ( 0 <= f->dst )
+        flow_send( &sh->c[f->dst], sh );
+    if ( 0 == f->left )
+    {   /* More messages of the kind are likely to follow. */
+        sh->ci[cp - sh->c].bulk = 1;
+        cp->rxflow = NULL;
+        f->src = -1;
+        flow_release( f );
+    }
+    return r;
+}
+
+/* Write up to max bytes of the client's send queue at once, and dequeue
+ * what was sent; synchronous backends only. Large writes go without
+ * copying, if enabled. Returns the result of writev(). */
+static int client_write( client_t *cp, size_t max, shard_t *sh )
+{
+    client_info_t *ci = &sh->ci[cp - sh->c];
+    struct iovec iov[MBUF_IOV_MAX];
+    size_t len;
+    int n, w;
+
+    if ( NULL != cp->txflow )
+        return flow_send( cp, sh );
+    if ( NULL == cp->qhead )
+        return errno = EAGAIN, -1;
+    ctl_splice( cp );
+    n = mbuf_iovec( cp->qhead, iov, MBUF_IOV_MAX, max, &len );
+    if ( ci->zc && (size_t)cfg.zerocopy_min <= len )
+    {
+        if ( 0 < ( w = zcopy_sendv( cp->fd, iov, n ) ) )
+            ++ci->zc_seq;
+        else if ( 0 > w && ENOBUFS == errno )
+        {   /* Out of socket option memory to track the send, as is to be
+             * expected under load; copy the data this time. */
+            DLOG( "Zero-copy send to c[%d] refused, copying.\n", (int)( cp - sh->c ) );
+            w = writev( cp->fd, iov, n );
+        }
+    }
+    else
+        w = writev( cp->fd, iov, n );
+    if ( 0 < w )
+        dequeue_msg( cp, w, sh );
+    return w;
+}
+
+static int enqueue_msg( client_t *cp, mbuf_t *m, shard_t *sh )
+{
+    client_info_t *ci = &sh->ci[cp - sh->c];
+    time_t t;
+
+    DLOG( "%p\n", m );
+    if ( ttl_expired( m ) )
+    {
+        mbuf_free( &m );
+        return 0;
+    }
+    m->boff = 0;
+    m->next = NULL;
+    m->qtime = MONOTIME();
+    if ( 0 == ci->qbytes )
+    {   /* Measure the drain rate from here on. */
+        ci->dsince = m->qtime;
+        ci->drained = 0;
+    }
+    queue_account( cp, (ssize_t)m->bsize, sh );
+    if ( NULL != cp->qhead )
+    {   /* Backlogged: control messages take the priority lane, unless
+         * their flow may have messages queued already, which they must
+         * not overtake; the rest wait for a fair share. */
+        subq_t *q = subq_find( cp, m );
+
+        if ( IS_CONTROL( m ) && NULL == q && 0 == ( cp->qflows & flow_bit( m ) ) )
+            queue_urgent( cp, m );
+        else
+            subq_put( cp, q, m );
+    }
+    else
+    {
+        cp->qhead = cp->qtail = m;
+        cp->qflows = flow_bit( m );
+        /* Idle connection, try to send right away. Errors surface
+         * again once the socket is reported ready. */
+        if ( poller_is_async( sh->pl ) || 0 >= client_write( cp, MBUF_IOV_BUDGET, sh ) )
+            client_arm_send( cp, sh );
+    }
+    /* Make sure a slow consumer is noticed in time. */
+    if ( NULL != cp->qhead
+        && ( ( 0 < cfg.queue_max_bytes && ci->qbytes > (size_t)cfg.queue_max_bytes )
+             || ( 0 < cfg.queue_max_age && twheel_due( sh->tw, (int)( cp - sh->c ) - sh->lo )
+                                           > m->qtime + cfg.queue_max_age + 1 )
+             || ( 0 != ( t = drain_check_due( ci, m->qtime ) )
+                  && twheel_due( sh->tw, (int)( cp - sh->c ) - sh->lo ) > t ) ) )
+        client_arm_timer( cp, sh );
+    return 0;
+}
+
+/* Pass a message on to a client, possibly owned by a different shard. */
+static int handoff_msg( client_t *c, int i_dst, mbuf_t *m, shard_t *sh )
+{
+    shard_t *dsh = &shards[i_dst / shard_size];
+    mbuf_t *old;
+
+    if ( dsh == sh )
+        return enqueue_msg( &c[i_dst], m, sh );
+    /* The offset is free for use until the message is enqueued. */
+    m->boff = i_dst;
+    old = __atomic_load_n( &dsh->mbox, __ATOMIC_RELAXED );
+    do
+        m->next = old;
+    while ( !__atomic_compare_exchange_n( &dsh->mbox, &old, m, 1,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED ) );
+    if ( NULL == old )
+        wake_shard( dsh );
+    return 0;
+}
+
+/* Collect messages and requests handed over by other shards. */
+static int drain_mailbox( client_t *c, shard_t *sh )
+{
+    char buf[64];
+    mbuf_t *m, *next, *fifo = NULL;
+    shard_cmd_t *cmd;
+    int ncmd;
+
+    while ( 0 < read( sh->wake[0], buf, sizeof buf ) )
+        continue;
+    m = __atomic_exchange_n( &sh->mbox, NULL, __ATOMIC_ACQUIRE );
+    for ( ; NULL != m; m = next )
+    {   /* Restore arrival order. */
+        next = m->next;
+        m->next = fifo;
+        fifo = m;
+    }
+    for ( m = fifo; NULL != m; m = next )
+    {
+        int i = (int)m->boff;
+        next = m->next;
+        /* Destination may have left since the hand-off. */
+        if ( 0 <= c[i].fd && CLT_AUTH_OK == c[i].st && HDR_GET_DSTID( m ) == c[i].id )
+            enqueue_msg( &c[i], m, sh );
+        else
+        {
+            DLOG( "Dropping message for departed c[%d].\n", i );
+            mbuf_free( &m );
+        }
+    }
+    pthread_mutex_lock( &sh->cmd_lock );
+    cmd = sh->cmd;
+    ncmd = sh->ncmd;
+    sh->cmd = NULL;
+    sh->ncmd = sh->cmd_sz = 0;
+    pthread_mutex_unlock( &sh->cmd_lock );
+    for ( int k = 0; k < ncmd; ++k )
+    {
+        int i = cmd[k].arg;
+        switch ( cmd[k].cmd )
+        {
+        case CMD_KICK:
+            if ( 0 <= c[i].fd && cmd[k].id == c[i].id )
+                close_client( &c[i], sh );
+            break;
+        case CMD_ADOPT:
+            adopt_client( c, cmd[k].arg, &cmd[k].addr, cmd[k].addrlen, sh );
+            break;
+        case CMD_CTL:
+            ctl_finish( c, cmd[k].job, sh );
+            break;
+        default:
+            break;
+        }
+    }
+    free( cmd );
+    return 0;
+}
+
+static int process_server_msg( client_t *c, int i_src, shard_t *sh )
+{
+    uint16_t mtype = HDR_GET_TYPE( c[i_src].rbuf );
+    enum MSG_ATTRIB at;
+    size_t al;
+    void *av;
+    ctl_job_t *job;
+    client_info_t *ci = sh->ci;
+
+    if ( CLT_AUTH_OK != c[i_src].st
+        && MSG_TYPE_LOGIN_REQ != mtype
+        && MSG_TYPE_AUTH_REQ != mtype
+        && MSG_TYPE_REGISTER_REQ != mtype )
+    {
+        mbuf_to_error_response( &c[i_src].rbuf, SC_FORBIDDEN );
+        return -1;
+    }
+    mbuf_resetgetattrib( c[i_src].rbuf );
+    switch ( mtype )
+    {
+    case MSG_TYPE_PING_IND:
+        /* Nothing to be done - client activity already recorded. */
+        mbuf_free( &c[i_src].rbuf );
+        break;
     case MSG_TYPE_PING_REQ:
         mbuf_to_response( &c[i_src].rbuf );
         mbuf_addattrib( &c[i_src].rbuf, MSG_ATTR_OK, 0, NULL );
@@ -524,19 +2313,11 @@ static int process_server_msg( client_t *c, int i_src, fd_set *m_rfds, fd_set *m
             mbuf_to_error_response( &c[i_src].rbuf, SC_BAD_REQUEST );
         }
         else
-        {
-            char *key;
-            key = strdupcat_s( AUTH_KEY_PLAINTEXT, av );
-            udb_dropentry( c[i_src].name ); /* Not exactly elegant ... */
-            if ( NULL != ( pu = udb_addentry( c[i_src].id, c[i_src].name, key ) ) )
-            {
-                mbuf_to_response( &c[i_src].rbuf );
-                mbuf_addattrib( &c[i_src].rbuf, MSG_ATTR_OK, 0, NULL );
-                mbuf_addattrib( &c[i_src].rbuf, MSG_ATTR_NOTICE, sizeof TXT_REGISTERED, TXT_REGISTERED );
-            }
-            else
-                mbuf_to_error_response( &c[i_src].rbuf, SC_LOCKED );
-            free( key );
+        {   /* Have the control thread update the user db. */
+            job = ctl_new( c, i_src, sh );
+            job->name = strdup_s( ci[i_src].name );
+            job->arg = strdupcat_s( AUTH_KEY_PLAINTEXT, av );
+            ctl_submit( job, sh );
         }
         break;
     case MSG_TYPE_DROP_REQ:
@@ -544,17 +2325,11 @@ static int process_server_msg( client_t *c, int i_src, fd_set *m_rfds, fd_set *m
         if ( CLT_AUTH_OK != c[i_src].st )
         {
             mbuf_to_error_response( &c[i_src].rbuf, SC_UNAUTHORIZED );
+            break;
         }
-        else if ( 0 != udb_dropentry( c[i_src].name ) )
-        {
-            mbuf_to_error_response( &c[i_src].rbuf, SC_NOT_FOUND );
-        }
-        else
-        {
-            mbuf_to_response( &c[i_src].rbuf );
-            mbuf_addattrib( &c[i_src].rbuf, MSG_ATTR_OK, 0, NULL );
-            mbuf_addattrib( &c[i_src].rbuf, MSG_ATTR_NOTICE, sizeof TXT_DROPPED, TXT_DROPPED );
-        }
+        job = ctl_new( c, i_src, sh );
+        job->name = strdup_s( ci[i_src].name );
+        ctl_submit( job, sh );
         break;
     case MSG_TYPE_LOGIN_REQ:
         DLOG( "WIP: Process LOGIN request.\n" );
@@ -563,44 +2338,19 @@ static int process_server_msg( client_t *c, int i_src, fd_set *m_rfds, fd_set *m
             || at != MSG_ATTR_USERNAME )
         {
             mbuf_to_error_response( &c[i_src].rbuf, SC_BAD_REQUEST );
+            break;
         }
-        else if ( NULL == ( pu = udb_lookupname( (char *)av ) ) )
-        {   /* Login as unregistered user. */
-            int i = cfg.max_clients;
-            for ( i = 0; i < cfg.max_clients; ++i )
-                if ( 0 <= c[i].fd && NULL != c[i].name
-                    && 0 == stricmp( c[i].name, (char *)av ) )
-                    break;
-            if ( i != cfg.max_clients )
-            {   /* Name already in use. */
-                mbuf_to_error_response( &c[i_src].rbuf, SC_CONFLICT );
-            }
-            else
-            {
-                c[i_src].st = CLT_AUTH_OK;
-                c[i_src].id = udb_gettempid();
-                c[i_src].name = strdup_s( (char *)av );
-                c[i_src].key = NULL;
-                mbuf_to_response( &c[i_src].rbuf );
-                mbuf_addattrib( &c[i_src].rbuf, MSG_ATTR_OK, 0, NULL );
-                mbuf_addattrib( &c[i_src].rbuf, MSG_ATTR_NOTICE, strlen( motd ) + 1, motd );
-            }
-        }
-        else
-        {   /* Registered user: send challenge. */
-            c[i_src].st = CLT_LOGIN_OK;
-            c[i_src].id = pu->id;
-            c[i_src].name = strdup_s( pu->name );
-            /* PROOF OF CONCEPT ONLY (road works ahead): */
-            if ( 0 == strncmp( pu->key, AUTH_KEY_PLAINTEXT, strlen( AUTH_KEY_PLAINTEXT ) ) )
-            {
-                c[i_src].key = strdup_s( pu->key );
-                mbuf_to_response( &c[i_src].rbuf );
-                mbuf_addattrib( &c[i_src].rbuf, MSG_ATTR_CHALLENGE, strlen( AUTH_KEY_PLAINTEXT ) + 1, AUTH_KEY_PLAINTEXT );
-            }
-            else
-                mbuf_to_error_response( &c[i_src].rbuf, SC_METHOD_NOT_ALLOWED );
+        if ( overloaded() )
+        {   /* Sessions under way take precedence. */
+            __atomic_add_fetch( &admit_refusals, 1, __ATOMIC_RELAXED );
+            mbuf_to_error_response( &c[i_src].rbuf, SC_SERVICE_UNAVAILABLE );
+            mbuf_addattrib( &c[i_src].rbuf, MSG_ATTR_NOTICE, sizeof TXT_BUSY, TXT_BUSY );
+            break;
         }
+        /* Have the control thread look up the user. */
+        job = ctl_new( c, i_src, sh );
+        job->name = strdup_s( (char *)av );
+        ctl_submit( job, sh );
         break;
     case MSG_TYPE_AUTH_REQ:
         DLOG( "WIP: Process AUTH request.\n" );
@@ -608,24 +2358,17 @@ static int process_server_msg( client_t *c, int i_src, fd_set *m_rfds, fd_set *m
             || 0 != mbuf_getnextattrib( c[i_src].rbuf, &at, &al, &av )
             || at != MSG_ATTR_DIGEST )
         {
+            DIR_WRLOCK();
             c[i_src].st = CLT_PRE_LOGIN;
+            DIR_UNLOCK();
             mbuf_to_error_response( &c[i_src].rbuf, SC_BAD_REQUEST );
             break;
         }
-        /* PROOF OF CONCEPT ONLY (road works ahead): */
-        if ( 0 != strcmp( (const char *)av, c[i_src].key ) )
-        {
-            c[i_src].st = CLT_PRE_LOGIN;
-            mbuf_to_error_response( &c[i_src].rbuf, SC_UNAUTHORIZED );
-            break;
-        }
-        for ( int i = 0; i < cfg.max_clients; ++i )
-            if ( c[i_src].id == c[i].id && i_src != i && 0 <= c[i].fd )
-                close_client( &c[i], m_rfds, m_wfds );
-        c[i_src].st = CLT_AUTH_OK;
-        mbuf_to_response( &c[i_src].rbuf );
-        mbuf_addattrib( &c[i_src].rbuf, MSG_ATTR_OK, 0, NULL );
-        mbuf_addattrib( &c[i_src].rbuf, MSG_ATTR_NOTICE, strlen( motd ) + 1, motd );
+        /* Have the control thread check the digest. */
+        job = ctl_new( c, i_src, sh );
+        job->key = NULL != ci[i_src].key ? strdup_s( ci[i_src].key ) : NULL;
+        job->arg = strdup_s( (const char *)av );
+        ctl_submit( job, sh );
         break;
     case MSG_TYPE_LOGOUT_REQ:
         DLOG( "Process LOGOUT request.\n" );
@@ -634,25 +2377,58 @@ static int process_server_msg( client_t *c, int i_src, fd_set *m_rfds, fd_set *m
             mbuf_to_error_response( &c[i_src].rbuf, SC_UNAUTHORIZED );
             break;
         }
+        DIR_WRLOCK();
+        pdir_del( i_src );
+        if ( CLT_AUTH_OK == c[i_src].st )
+            peer_gone( c, i_src, sh );
         c[i_src].st = CLT_PRE_LOGIN;
         c[i_src].id = 0ULL;
-        free( c[i_src].name ); c[i_src].name = NULL;
-        free( c[i_src].key ); c[i_src].key = NULL;
+        free( ci[i_src].name ); ci[i_src].name = NULL;
+        free( ci[i_src].key ); ci[i_src].key = NULL;
+        DIR_UNLOCK();
         mbuf_to_response( &c[i_src].rbuf );
         mbuf_addattrib( &c[i_src].rbuf, MSG_ATTR_OK, 0, NULL );
         mbuf_addattrib( &c[i_src].rbuf, MSG_ATTR_NOTICE, sizeof TXT_BYE, TXT_BYE );
         break;
     case MSG_TYPE_PEERLIST_REQ:
         DLOG( "Process PEERLIST request.\n" );
-        mbuf_to_response( &c[i_src].rbuf );
-        for ( int i = 0; i < cfg.max_clients; ++i )
         {
-            if ( 0 <= c[i].fd && CLT_AUTH_OK == c[i].st )
+            mshared_t *pl = NULL;
+            char *prefix = NULL, *cursor = NULL;
+            int sub = -1;
+
+            while ( 0 == mbuf_getnextattrib( c[i_src].rbuf, &at, &al, &av ) )
             {
-                mbuf_addattrib( &c[i_src].rbuf, MSG_ATTR_PEERID, 8, c[i].id );
-                mbuf_addattrib( &c[i_src].rbuf, MSG_ATTR_PEERNAME,
-                                strlen( c[i].name ) + 1, c[i].name );
+                if ( MSG_ATTR_SUBSCRIBE == at && 8 == al )
+                    sub = 0 != NTOH64( *(uint64_t *)av );
+                else if ( 0 == al || '\0' != ((char *)av)[al - 1] )
+                    continue;
+                else if ( MSG_ATTR_PREFIX == at && NULL == prefix )
+                    prefix = strdup_s( av );
+                else if ( MSG_ATTR_CURSOR == at && NULL == cursor )
+                    cursor = strdup_s( av );
             }
+            mbuf_to_response( &c[i_src].rbuf );
+            if ( 0 > sub )
+                DIR_RDLOCK();
+            else
+            {   /* Start or stop the delta stream on top of a fresh list. */
+                DIR_WRLOCK();
+                presence_flush( c, sh );
+                presence_subscribe( i_src, sub );
+            }
+            if ( NULL == prefix && NULL == cursor )
+                pl = peerlist_get( c );
+            else
+                peerlist_page( &c[i_src].rbuf, c, prefix, cursor );
+            DIR_UNLOCK();
+            if ( NULL != pl )
+            {
+                mbuf_attach( &c[i_src].rbuf, pl );
+                mshared_unref( &pl );
+            }
+            free( prefix );
+            free( cursor );
         }
         break;
     /* Anything else is nonsense: */
@@ -673,7 +2449,7 @@ static int process_server_msg( client_t *c, int i_src, fd_set *m_rfds, fd_set *m
     return 0;
 }
 
-static int process_broadcast_msg( client_t *c, int i_src, fd_set *m_wfds )
+static int process_broadcast_msg( client_t *c, int i_src, shard_t *sh )
 {
     uint16_t mtype = HDR_GET_TYPE( c[i_src].rbuf );
 
@@ -699,33 +2475,112 @@ static int process_broadcast_msg( client_t *c, int i_src, fd_set *m_wfds )
         break;
     }
     return 0;
-    (void)m_wfds;
+    (void)sh;
+}
+
+/* Answer a GETFILE request from the chunk cache, if possible, turning
+ * it into the response; else note it, for the chunk in the response to
+ * be cached. Returns 0 if answered. */
+static int cache_serve( client_t *c, int i_src )
+{
+    mbuf_t *m = c[i_src].rbuf;
+    enum MSG_ATTRIB at;
+    size_t al;
+    void *av;
+    uint64_t oid = 0, off = 0, size = 0;
+    mshared_t *pay;
+
+    mbuf_resetgetattrib( m );
+    while ( 0 == mbuf_getnextattrib( m, &at, &al, &av ) )
+    {
+        if ( 8 != al )
+            continue;
+        if ( MSG_ATTR_OFFERID == at )
+            oid = NTOH64( *(uint64_t *)av );
+        else if ( MSG_ATTR_OFFSET == at )
+            off = NTOH64( *(uint64_t *)av );
+        else if ( MSG_ATTR_SIZE == at )
+            size = NTOH64( *(uint64_t *)av );
+    }
+    /* Requests for nothing signal the end of the download to the source. */
+    if ( 0 == oid || 0 == size )
+        return -1;
+    pthread_mutex_lock( &cache_lock );
+    if ( NULL == ( pay = cache_get( HDR_GET_DSTID( m ), c[i_src].id, oid, off, size ) ) )
+        cache_expect( HDR_GET_DSTID( m ), c[i_src].id, HDR_GET_TRFID( m ), oid, off, size );
+    pthread_mutex_unlock( &cache_lock );
+    if ( NULL == pay )
+        return -1;
+    /* The response appears to come from the source. */
+    mbuf_to_response( &c[i_src].rbuf );
+    mbuf_attach( &c[i_src].rbuf, pay );
+    mshared_unref( &pay );
+    return 0;
+}
+
+/* Keep the chunk carried by a GETFILE response, if one was expected;
+ * the cached payload is made up of the OFFERID and DATA attributes,
+ * leaving out a TTL in between. */
+static void cache_store( mbuf_t *m )
+{
+    enum MSG_ATTRIB at;
+    size_t al, len;
+    void *av;
+    uint64_t oid;
+    uint8_t *pay = m->b + MSG_HDR_SIZE, *data, *buf = NULL;
+
+    mbuf_resetgetattrib( m );
+    if ( 0 != mbuf_getnextattrib( m, &at, &al, &av )
+        || MSG_ATTR_OFFERID != at || 8 != al )
+        return;
+    oid = NTOH64( *(uint64_t *)av );
+    if ( 0 != mbuf_getnextattrib( m, &at, &al, &av )
+        || ( MSG_ATTR_TTL == at && 0 != mbuf_getnextattrib( m, &at, &al, &av ) )
+        || MSG_ATTR_DATA != at || 0 == al )
+        return;
+    data = (uint8_t *)av - 8;
+    len = 16 + 8 + ROUNDUP8( al );
+    if ( data != pay + 16 )
+    {   /* Join the attributes. */
+        buf = malloc_s( len );
+        memcpy( buf, pay, 16 );
+        memcpy( buf + 16, data, len - 16 );
+        pay = buf;
+    }
+    pthread_mutex_lock( &cache_lock );
+    cache_put( HDR_GET_SRCID( m ), HDR_GET_DSTID( m ), HDR_GET_TRFID( m ), oid, pay, len );
+    pthread_mutex_unlock( &cache_lock );
+    free( buf );
 }
 
-static int process_forward_msg( client_t *c, int i_src, fd_set *m_wfds )
+static int process_forward_msg( client_t *c, int i_src, shard_t *sh )
 {
     int i_dst;
     uint16_t mtype = HDR_GET_TYPE( c[i_src].rbuf );
+    uint64_t dstid = HDR_GET_DSTID( c[i_src].rbuf );
 
     if ( CLT_AUTH_OK != c[i_src].st )
     {
         mbuf_to_error_response( &c[i_src].rbuf, SC_FORBIDDEN );
         return -1;
     }
+    ttl_start( c[i_src].rbuf, mbuf_ttl( c[i_src].rbuf ) );
 
-    for ( i_dst = 0; i_dst < cfg.max_clients; ++i_dst )
-    {
-        if ( 0 <= c[i_dst].fd
-            && CLT_AUTH_OK == c[i_dst].st
-            && HDR_GET_DSTID( c[i_src].rbuf ) == c[i_dst].id )
-            break;
-    }
-    if ( i_dst == cfg.max_clients )
+    i_dst = route_lookup( c, dstid );
+    if ( 0 > i_dst )
     {
         DLOG( "Add error response to c[%d] send queue.\n", i_src );
         mbuf_to_error_response( &c[i_src].rbuf, SC_MISDIRECTED_REQUEST );
         return -1;
     }
+    if ( 0 < cfg.cache_size && MSG_TYPE_GETFILE_REQ == mtype
+        && 0 == cache_serve( c, i_src ) )
+    {
+        DLOG( "Answered c[%d] from the chunk cache.\n", i_src );
+        return 0;
+    }
+    if ( 0 < cfg.cache_size && MSG_TYPE_GETFILE_RES == mtype )
+        cache_store( c[i_src].rbuf );
     switch ( mtype )
     {
     case MSG_TYPE_OFFER_IND:
@@ -740,8 +2595,9 @@ static int process_forward_msg( client_t *c, int i_src, fd_set *m_wfds )
     case MSG_TYPE_PING_RES:
     case MSG_TYPE_PING_ERR:
         DLOG( "Forwarding message to c[%d] send queue.\n", i_dst );
-        enqueue_msg( &c[i_dst], c[i_src].rbuf, m_wfds );
+        handoff_msg( c, i_dst, c[i_src].rbuf, sh );
         c[i_src].rbuf = NULL;
+        throttle( c, i_src, i_dst, sh );
         break;
     /* Anything else is nonsense: */
     default:
@@ -761,7 +2617,99 @@ static int process_forward_msg( client_t *c, int i_src, fd_set *m_wfds )
     return 0;
 }
 
-static int process_msg( client_t *c, int i_src, fd_set *m_rfds, fd_set *m_wfds )
+/* Start passing on the message being received from client i before it
+ * is complete, if it is a large one to be forwarded to an idle client of
+ * the same shard; bulk data is spliced. The message is charged to the
+ * destination's queue until passed on in full. An expired message is
+ * dropped as it comes in. Returns 0 if the flow is set up, or -1 if the
+ * message is to take the buffered path. */
+static int flow_start( client_t *c, int i, shard_t *sh )
+{
+    mbuf_t *m = c[i].rbuf;
+    uint64_t dstid = HDR_GET_DSTID( m ), ttl;
+    flow_t *f;
+    int i_dst;
+
+    if ( poller_is_async( sh->pl ) || CLT_AUTH_OK != c[i].st
+        || CUT_MIN_SIZE > m->bsize - m->boff )
+        return -1;
+    switch ( HDR_GET_TYPE( m ) )
+    {
+    case MSG_TYPE_OFFER_IND:
+    case MSG_TYPE_OFFER_REQ:
+    case MSG_TYPE_OFFER_RES:
+    case MSG_TYPE_OFFER_ERR:
+    case MSG_TYPE_GETFILE_REQ:
+    case MSG_TYPE_GETFILE_RES:
+    case MSG_TYPE_GETFILE_ERR:
+    case MSG_TYPE_PING_IND:
+    case MSG_TYPE_PING_REQ:
+    case MSG_TYPE_PING_RES:
+    case MSG_TYPE_PING_ERR:
+        break;
+    default:
+        return -1;
+    }
+    if ( 0 < cfg.cache_size && MSG_TYPE_GETFILE_RES == HDR_GET_TYPE( m ) )
+    {   /* Chunks to be cached have to be received in full. */
+        int r;
+
+        pthread_mutex_lock( &cache_lock );
+        r = cache_expected( c[i].id, dstid, HDR_GET_TRFID( m ) );
+        pthread_mutex_unlock( &cache_lock );
+        if ( r )
+            return -1;
+    }
+    /* The attributes ahead of the data have to be in to check the TTL. */
+    if ( 0 != mbuf_head_ttl( m, &ttl ) )
+        return -1;
+    ttl_start( m, ttl );
+    if ( ttl_expired( m ) )
+    {
+        f = malloc_s( sizeof *f );
+        f->src = i;
+        f->dst = -1;
+        f->left = m->bsize - m->boff;
+        f->size = 0;
+        f->buf = NULL;
+        f->sent = 0;
+        f->pipe = NULL;
+        f->full = 0;
+        mbuf_free( &c[i].rbuf );
+        c[i].rxflow = f;
+        return 0;
+    }
+    i_dst = route_lookup( c, dstid );
+    if ( 0 > i_dst || i_dst == i || i_dst < sh->lo || sh->hi <= i_dst
+        || NULL != c[i_dst].qhead || NULL != c[i_dst].txflow || queue_full( i_dst, sh ) )
+        return -1;
+    f = malloc_s( sizeof *f );
+    f->src = i;
+    f->dst = i_dst;
+    f->left = m->bsize - m->boff;
+    f->size = m->bsize;
+    f->buf = m;
+    f->sent = 0;
+    f->pipe = NULL;
+    f->full = 0;
+    if ( IS_BULK( m ) && SPLICE_MIN_SIZE <= f->left )
+        f->pipe = spipe_new();
+    DLOG( "Passing on %zu bytes from c[%d] to c[%d]%s.\n", f->left, i, i_dst,
+            NULL != f->pipe ? " through a pipe" : "" );
+    HDR_SET_SRCID( m, c[i].id );
+    if ( 0 == sh->ci[i_dst].qbytes )
+    {   /* Measure the drain rate from here on. */
+        sh->ci[i_dst].dsince = MONOTIME();
+        sh->ci[i_dst].drained = 0;
+    }
+    queue_account( &c[i_dst], (ssize_t)f->size, sh );
+    c[i].rbuf = NULL;
+    c[i].rxflow = c[i_dst].txflow = f;
+    client_write( &c[i_dst], MBUF_IOV_BUDGET, sh );
+    return 0;
+}
+
+static int process_msg( client_t *c, int i_src, shard_t *sh )
 {
     int r;
     uint64_t dstid = HDR_GET_DSTID( c[i_src].rbuf );
@@ -773,16 +2721,17 @@ static int process_msg( client_t *c, int i_src, fd_set *m_rfds, fd_set *m_wfds )
     mbuf_dump( c[i_src].rbuf );
 
     if ( 0ULL == dstid )
-        r = process_server_msg( c, i_src, m_rfds, m_wfds );
+        r = process_server_msg( c, i_src, sh );
     else if ( ~0ULL == dstid )
-        r = process_broadcast_msg( c, i_src, m_wfds );
+        r = process_broadcast_msg( c, i_src, sh );
     else
-        r = process_forward_msg( c, i_src, m_wfds );
+        r = process_forward_msg( c, i_src, sh );
     /* Send back the response, if any: */
     if ( NULL != c[i_src].rbuf )
     {
-        enqueue_msg( &c[i_src], c[i_src].rbuf, m_wfds );
+        enqueue_msg( &c[i_src], c[i_src].rbuf, sh );
         c[i_src].rbuf = NULL;
+        throttle( c, i_src, i_src, sh );
     }
     return r;
 }
@@ -793,205 +2742,666 @@ static int process_msg( client_t *c, int i_src, fd_set *m_rfds, fd_set *m_wfds )
  *
  */
 
-static int handle_io( client_t *c, int nset,
-            fd_set *rfds, fd_set *wfds, fd_set *m_rfds, fd_set *m_wfds )
+/* Deal with the outcome of a write to a client, closing the connection
+ * on errors. Returns the number of bytes written, or 0 if none. */
+static int client_wrote( client_t *cp, int w, shard_t *sh )
 {
-    int i;
-    time_t now = time( NULL );
+    if ( 0 > w )
+    {
+        if ( EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno )
+        {
+            XLOG( LOG_ERR, "writev() failed: %m.\n" );
+            close_client( cp, sh );
+        }
+        else
+            client_arm_send( cp, sh );
+        return 0;
+    }
+    if ( 0 == w )
+    {
+        DLOG( "WTF, writev() returned 0: %m.\n" );
+        close_client( cp, sh );
+        return 0;
+    }
+    DLOG( "%d bytes sent to c[%d]\n", w, (int)( cp - sh->c ) );
+    /* Trickling out a backlog below the minimum rate is no activity. */
+    if ( !drains_slowly( &sh->ci[cp - sh->c], MONOTIME() ) )
+        cp->act = MONOTIME();
+    return w;
+}
+
+/* Dispatch all messages completed by the data received so far. While
+ * a control-plane request is pending, the rest is held back, to keep
+ * the client's messages in order. */
+static int client_dispatch( client_t *c, int i, const uint8_t *data, size_t len,
+                            shard_t *sh )
+{
+    client_info_t *ci = &sh->ci[i];
 
-    for ( i = 0; i < cfg.max_clients && 0 < nset; ++i )
+    while ( !ci->ctl && mbuf_fill( &c[i].rbuf, &data, &len ) )
     {
-        if ( 0 > c[i].fd )
+        if ( IS_BULK( c[i].rbuf ) )
+            ci->bulk = 1;
+        process_msg( c, i, sh );
+        c[i].rbuf = NULL;
+    }
+    if ( ci->ctl && 0 < len )
+    {   /* Keep the rest for later. */
+        ci->held = realloc_s( ci->held, ci->nheld + len );
+        memcpy( ci->held + ci->nheld, data, len );
+        ci->nheld += len;
+        return 0;
+    }
+    /* Pass on a large message while receiving the rest. */
+    if ( NULL != c[i].rbuf && MSG_HDR_SIZE < c[i].rbuf->bsize )
+        flow_start( c, i, sh );
+    return 0;
+}
+
+static int handle_io( client_t *c, shard_t *sh, poller_event_t *evs, int nev )
+{
+    time_t now = MONOTIME();
+
+    for ( int e = 0; e < nev; ++e )
+    {
+        int i = evs[e].tag;
+
+        /* Skip non-client events and clients closed in the meantime. */
+        if ( 0 > i || c[i].fd != evs[e].fd )
+            continue;
+
+        /* Collect zero-copy send completions, reported as errors. */
+        if ( sh->ci[i].zc_seq != sh->ci[i].zc_done
+            && 0 != client_zc_reap( &c[i], sh ) )
+        {
+            close_client( &c[i], sh );
+            continue;
+        }
+        if ( ( evs[e].ev & POLLER_ERR ) && 0 != client_error( &c[i] ) )
+        {   /* Anything else is fatal. */
+            XLOG( LOG_ERR, "Connection to c[%d] failed: %m.\n", i );
+            close_client( &c[i], sh );
             continue;
+        }
 
-        /* Handle fds ready for reading. */
-        if ( FD_ISSET( c[i].fd, rfds ) )
+        /* Handle fds ready for reading, or completed receives. */
+        if ( evs[e].ev & ( POLLER_IN | POLLER_RECV ) )
         {
-            --nset;
+            const uint8_t *data = sh->rx;
+            size_t len = 0;
+            int r, flowing = 0;
+
             /* Detect message timeouts. */
-            resync_client( &c[i], now );
-            /* Prepare receive buffer. */
-            if ( NULL == c[i].rbuf )
-                mbuf_new( &c[i].rbuf );
+            if ( evs[e].ev & POLLER_IN )
+                resync_client( &c[i], now, sh );
             c[i].act = now;
+            errno = 0;
+            if ( evs[e].ev & POLLER_RECV )
+            {   /* Data is already in place. */
+                if ( 0 > ( r = evs[e].res ) )
+                    errno = -r, r = -1;
+            }
+            else if ( NULL != c[i].rxflow )
+            {   /* Payload of a message already being passed on. */
+                r = flow_recv( &c[i], sh );
+                flowing = 1;
+            }
+            else
+            {   /* Complete a pending message in place, and read whatever
+                 * else is available into the shard's receive buffer. After
+                 * a bulk message, read the next header alone, as it may
+                 * well start a splice. */
+                struct iovec iov[2];
+                int n = 0, hdr = NULL == c[i].rbuf && sh->ci[i].bulk;
 
-            if ( c[i].rbuf->boff < c[i].rbuf->bsize )
-            {   /* Message buffer not yet filled. */
-                int r;
-                errno = 0;
-                r = read( c[i].fd, c[i].rbuf->b + c[i].rbuf->boff,
-                            c[i].rbuf->bsize - c[i].rbuf->boff );
-                if ( 0 > r )
+                if ( hdr )
                 {
-                    if ( EAGAIN != errno
-                        && EWOULDBLOCK != errno && EINTR != errno )
-                    {
-                        XLOG( LOG_ERR, "read() failed: %m.\n" );
-                        close_client( &c[i], m_rfds, m_wfds );
-                        continue;
-                    }
-                    goto SKIP_TO_WRITE;
+                    mbuf_new( &c[i].rbuf );
+                    sh->ci[i].bulk = 0;
                 }
-                if ( 0 == r )
+                if ( NULL != c[i].rbuf )
                 {
-                    DLOG( "Client closed connection.\n" );
-                    close_client( &c[i], m_rfds, m_wfds );
-                    continue;
-                }
-                DLOG( "%d bytes received from c[%d]\n", r, i );
-                c[i].rbuf->boff += r;
-            }
-            if ( c[i].rbuf->boff == c[i].rbuf->bsize )
-            {   /* Buffer filled. */
-                if ( c[i].rbuf->boff == MSG_HDR_SIZE )
-                {   /* Only received header yet. */
-                    uint16_t paylen = HDR_GET_PAYLEN( c[i].rbuf );
-                    if ( paylen > 0 )
-                    {   /* Prepare for receiving payload next. */
-                        DLOG( "Grow message buffer by %lu.\n", paylen );
-                        mbuf_resize( &c[i].rbuf, paylen );
-                    }
-                    DLOG( "Expecting %"PRIu16" bytes of payload data.\n", paylen );
+                    iov[n].iov_base = c[i].rbuf->b + c[i].rbuf->boff;
+                    iov[n++].iov_len = c[i].rbuf->bsize - c[i].rbuf->boff;
                 }
-                if ( c[i].rbuf->boff == c[i].rbuf->bsize )
-                {   /* Payload data complete. */
-                    process_msg( c, i, m_rfds, m_wfds );
-                    c[i].rbuf = NULL;
+                if ( !hdr )
+                {
+                    iov[n].iov_base = sh->rx;
+                    iov[n++].iov_len = RX_BUF_SIZE;
                 }
+                r = readv( c[i].fd, iov, n );
             }
-        }
-    SKIP_TO_WRITE:
-        /* Handle fds ready for writing. */
-        if ( FD_ISSET( c[i].fd, wfds ) )
-        {
-            --nset;
-            c[i].act = now;
-            if ( c[i].qhead->boff < c[i].qhead->bsize )
-            {   /* Message buffer not yet fully sent. */
-                int w;
-                errno = 0;
-                w = write( c[i].fd, c[i].qhead->b + c[i].qhead->boff,
-                            c[i].qhead->bsize - c[i].qhead->boff );
-                if ( 0 > w )
+            if ( 0 > r )
+            {
+                if ( EAGAIN != errno
+                    && EWOULDBLOCK != errno && EINTR != errno )
                 {
-                    if ( EAGAIN != errno
-                        && EWOULDBLOCK != errno && EINTR != errno )
-                    {
-                        XLOG( LOG_ERR, "write() failed: %m.\n" );
-                        close_client( &c[i], m_rfds, m_wfds );
-                    }
+                    XLOG( LOG_ERR, "read() failed: %m.\n" );
+                    close_client( &c[i], sh );
                     continue;
                 }
-                if ( 0 == w )
+                client_arm_recv( &c[i], sh );
+                goto SKIP_TO_WRITE;
+            }
+            if ( 0 == r )
+            {
+                DLOG( "Client closed connection.\n" );
+                close_client( &c[i], sh );
+                continue;
+            }
+            DLOG( "%d bytes received from c[%d]\n", r, i );
+            if ( !flowing )
+            {
+                if ( NULL != c[i].rbuf )
                 {
-                    DLOG( "WTF, write() returned 0: %m.\n" );
-                    close_client( &c[i], m_rfds, m_wfds );
-                    continue;
+                    size_t n = c[i].rbuf->bsize - c[i].rbuf->boff;
+
+                    if ( n > (size_t)r )
+                        n = r;
+                    c[i].rbuf->boff += n;
+                    len = r - n;
                 }
-                DLOG( "%d bytes sent to c[%d]\n", w, i );
-                c[i].qhead->boff += w;
+                else
+                    len = r;
+                client_dispatch( c, i, data, len, sh );
             }
-            if ( c[i].qhead->boff == c[i].qhead->bsize )
-            {   /* Message sent, remove from queue. */
-                dequeue_msg( &c[i], m_wfds );
+            /* Make sure a stalled partial message is noticed in time. */
+            if ( ( NULL != c[i].rxflow
+                   || ( NULL != c[i].rbuf && 0 < c[i].rbuf->boff ) )
+                && twheel_due( sh->tw, i - sh->lo ) > now + cfg.msg_timeout + 1 )
+                client_arm_timer( &c[i], sh );
+            client_arm_recv( &c[i], sh );
+        }
+    SKIP_TO_WRITE:
+        /* Handle fds ready for writing, or completed sends. */
+        if ( evs[e].ev & ( POLLER_OUT | POLLER_SEND ) )
+        {
+            int w;
+
+            /* Readiness alone does not count as activity, progress does. */
+            if ( evs[e].ev & POLLER_OUT )
+            {   /* Leave the writing to the output scheduler. */
+                sched_add( &c[i], sh );
+                continue;
             }
+            errno = 0;
+            sh->ci[i].sending = 0;
+            if ( 0 > ( w = evs[e].res ) )
+                errno = -w, w = -1;
+            if ( 0 < client_wrote( &c[i], w, sh ) )
+                dequeue_msg( &c[i], w, sh );
         }
     }
-    return nset;
+    return 0;
 }
 
-int main( int argc, char *argv[] )
+/* Serve the clients in the shard's output ring in deficit round robin
+ * order: on each visit, a client's deficit grows by one quantum, and it
+ * is sent up to that many bytes. Clients with more to send rejoin the
+ * ring, those with a full socket wait to be reported ready again. Stops
+ * after SCHED_BUDGET bytes, the rest carry on in the next iteration. */
+static int sched_run( client_t *c, shard_t *sh )
 {
-    int maxfd = -1;
-    int listenfd;
-    fd_set m_rfds, m_wfds;
-    client_t *clients;
-    struct timeval to_sav;
+    size_t budget = SCHED_BUDGET;
 
-    /* Initialization. */
-    die_if( 0 == getuid() || 0 == geteuid() || 0 == getgid() || 0 == getegid(),
-        "%s started with root privileges, aborting!\n", argv[0] );
-    signal( SIGPIPE, SIG_IGN );     /* Ceci n'est pas une pipe. */
-    /* TODO: gracefully handle termination signals (SIGINT, SIGQUIT, SIGTERM)? */
-    XLOG_INIT( argv[0], LOG_TO_SYSLOG|LOG_TO_FILE, stderr );
-    init_config( argc, argv );
-    udb_init( cfg.userdb_path );
-    to_sav = (struct timeval){ .tv_sec = cfg.select_timeout, 0 };
+    while ( 0 <= sh->rfirst && 0 < budget )
+    {
+        int i = sh->rfirst, w;
+        client_info_t *ci = &sh->ci[i];
 
-    /* Bring up the server. */
-    listenfd = init_server( &clients );
-    FD_ZERO( &m_rfds );
-    FD_ZERO( &m_wfds );
-#ifdef DEBUG
-    FD_SET( STDIN_FILENO, &m_rfds );
-#endif
-    FD_SET( listenfd, &m_rfds );
-    DLOG( "Entering main loop.\n" );
-    puts( "" ); /* May serve as a "service ready" signal for a supervisor. */
-    while ( 1 )
-    {
-        static time_t last_upkeep = 0;
-        time_t now;
-        int nset;
-        fd_set rfds, wfds;
-        struct timeval to;
-
-        now = time( NULL );
-        if ( now - last_upkeep > to_sav.tv_sec )
-        {   /* Avoid doing upkeep continuously under load. */
-            last_upkeep = now;
-            maxfd = listenfd;
-            upkeep( clients, &maxfd, &m_rfds, &m_wfds );
-            motd_get();
-        }
-        FD_COPY( &rfds, &m_rfds );
-        FD_COPY( &wfds, &m_wfds );
-        to = to_sav;
-        nset = select( maxfd + 1, &rfds, &wfds, NULL, &to );
-        if ( 0 < nset )
-        {
-            /* DLOG( "%d fds ready.\n", nset ); */
-            nset = handle_io( clients, nset, &rfds, &wfds, &m_rfds, &m_wfds );
-            if ( 0 < nset && 0 <= listenfd && FD_ISSET( listenfd, &rfds ) )
+        sched_del( &c[i], sh );
+        ci->deficit += cfg.sched_quantum;
+        errno = 0;
+        w = client_wrote( &c[i], client_write( &c[i], ci->deficit, sh ), sh );
+        if ( 0 > c[i].fd )
+            continue;
+        ci->deficit -= (size_t)w < ci->deficit ? (size_t)w : ci->deficit;
+        budget -= (size_t)w < budget ? (size_t)w : budget;
+        if ( !client_has_output( &c[i] ) )
+            ci->deficit = 0;
+        else if ( 0 < w )
+            sched_add( &c[i], sh );
+        else if ( ci->deficit > (size_t)cfg.sched_quantum )
+            ci->deficit = cfg.sched_quantum;
+    }
+    return 0;
+}
+
+/* Log buffer pool usage; explicitly asked for, hence logged with a
+ * priority that passes the default log level. */
+static void log_stats( void )
+{
+    mbuf_pool_stat_t st[MBUF_NCLS];
+    int nstalled = 0;
+    ntime_t lag = 0;
+    char buf[256];
+    int n = 0;
+
+    mbuf_pool_stats( st );
+    XLOG( LOG_WARNING, "mbuf pool hits/misses: hdr %lu/%lu, small %lu/%lu, max %lu/%lu.\n",
+            st[MBUF_CLS_HDR].hits, st[MBUF_CLS_HDR].misses,
+            st[MBUF_CLS_SMALL].hits, st[MBUF_CLS_SMALL].misses,
+            st[MBUF_CLS_MAX].hits, st[MBUF_CLS_MAX].misses );
+    for ( int k = 0; k < nshards; ++k )
+        nstalled += __atomic_load_n( &shards[k].nstalled, __ATOMIC_RELAXED );
+    XLOG( LOG_WARNING, "relay queues: %zu of %d bytes, %d clients stalled, %lu stalls, %lu evictions.\n",
+            __atomic_load_n( &relay_bytes, __ATOMIC_RELAXED ), cfg.relay_budget,
+            nstalled, __atomic_load_n( &relay_stalls, __ATOMIC_RELAXED ),
+            __atomic_load_n( &relay_evictions, __ATOMIC_RELAXED ) );
+    for ( int k = 0; k < nshards; ++k )
+        if ( lag < __atomic_load_n( &shards[k].lag, __ATOMIC_RELAXED ) )
+            lag = __atomic_load_n( &shards[k].lag, __ATOMIC_RELAXED );
+    XLOG( LOG_WARNING, "admission: loop lag %"PRI_ntime" us, %lu accept pauses, %lu logins refused.\n",
+            ntime_to_us( lag ), __atomic_load_n( &admit_pauses, __ATOMIC_RELAXED ),
+            __atomic_load_n( &admit_refusals, __ATOMIC_RELAXED ) );
+    buf[0] = '\0';
+    for ( int k = 0; k < TTL_NTYPES && n < (int)sizeof buf; ++k )
+    {
+        unsigned long d = __atomic_load_n( &ttl_drops[k], __ATOMIC_RELAXED );
+
+        if ( 0 < d )
+            n += snprintf( buf + n, sizeof buf - n, " %s %lu", mtype2str( k << 4 ), d );
+    }
+    XLOG( LOG_WARNING, "expired messages dropped:%s.\n", 0 < n ? buf : " none" );
+    if ( 0 < cfg.cache_size )
+    {
+        cache_stat_t cs;
+
+        pthread_mutex_lock( &cache_lock );
+        cache_stats( &cs );
+        pthread_mutex_unlock( &cache_lock );
+        XLOG( LOG_WARNING, "chunk cache: %lu hits, %lu misses, %lu stored, %lu spilled,"
+                " %zu bytes in memory, %zu in spill file.\n",
+                cs.hits, cs.misses, cs.stores, cs.spills, cs.mem, cs.spilled );
+    }
+}
+
+/**********************************************
+ * CONTROL PLANE
+ *
+ */
+
+/* Set up a control-plane request for the message just received from a
+ * client, taking it over. */
+static ctl_job_t *ctl_new( client_t *c, int i, shard_t *sh )
+{
+    ctl_job_t *job = malloc_s( sizeof *job );
+
+    memset( job, 0, sizeof *job );
+    job->sh = sh;
+    job->slot = i;
+    job->conn = sh->ci[i].conn;
+    job->id = c[i].id;
+    job->m = c[i].rbuf;
+    c[i].rbuf = NULL;
+    return job;
+}
+
+static void ctl_free( ctl_job_t *job )
+{
+    mbuf_free( &job->m );
+    free( job->name );
+    free( job->key );
+    free( job->arg );
+    free( job );
+}
+
+/* Queue a request for the control thread, and stop taking input from
+ * the client until it is done. */
+static void ctl_submit( ctl_job_t *job, shard_t *sh )
+{
+    sh->ci[job->slot].ctl = 1;
+    client_arm_send( &sh->c[job->slot], sh );
+    pthread_mutex_lock( &ctl_lock );
+    if ( NULL == ctl_tail )
+        ctl_head = job;
+    else
+        ctl_tail->next = job;
+    ctl_tail = job;
+    pthread_mutex_unlock( &ctl_lock );
+    pthread_cond_signal( &ctl_cond );
+}
+
+/* Carry out the user db part of a request; run by the control thread. */
+static void ctl_exec( ctl_job_t *job )
+{
+    const udb_t *pu;
+
+    switch ( HDR_GET_TYPE( job->m ) )
+    {
+    case MSG_TYPE_REGISTER_REQ:
+        udb_dropentry( job->name ); /* Not exactly elegant ... */
+        pu = udb_addentry( job->id, job->name, job->arg );
+        job->res = NULL != pu ? 0 : SC_LOCKED;
+        break;
+    case MSG_TYPE_DROP_REQ:
+        job->res = 0 != udb_dropentry( job->name ) ? SC_NOT_FOUND : 0;
+        break;
+    case MSG_TYPE_LOGIN_REQ:
+        if ( NULL == ( pu = udb_lookupname( job->name ) ) )
+        {   /* Unregistered user. */
+            job->id = udb_gettempid();
+            break;
+        }
+        job->id = pu->id;
+        free( job->name );
+        job->name = strdup_s( pu->name );
+        job->key = strdup_s( pu->key );
+        break;
+    case MSG_TYPE_AUTH_REQ:
+        /* PROOF OF CONCEPT ONLY (road works ahead): */
+        job->res = NULL == job->key || 0 != strcmp( job->arg, job->key )
+                 ? SC_UNAUTHORIZED : 0;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Control thread: serves control-plane requests in order, passing them
+ * back to the owning shard. */
+static void *ctl_run( void *arg )
+{
+    (void)arg;
+    for ( ;; )
+    {
+        shard_cmd_t cmd;
+        ctl_job_t *job;
+
+        pthread_mutex_lock( &ctl_lock );
+        while ( NULL == ctl_head )
+            pthread_cond_wait( &ctl_cond, &ctl_lock );
+        job = ctl_head;
+        if ( NULL == ( ctl_head = job->next ) )
+            ctl_tail = NULL;
+        job->next = NULL;
+        pthread_mutex_unlock( &ctl_lock );
+        ctl_exec( job );
+        memset( &cmd, 0, sizeof cmd );
+        cmd.cmd = CMD_CTL;
+        cmd.arg = job->slot;
+        cmd.job = job;
+        post_cmd( job->sh, &cmd );
+    }
+    return NULL;
+}
+
+/* Apply the outcome of a control-plane request to the client, send the
+ * response, and go on with the input held back meanwhile. */
+static int ctl_finish( client_t *c, ctl_job_t *job, shard_t *sh )
+{
+    int i = job->slot;
+    client_info_t *ci = sh->ci;
+    mbuf_t *m = job->m;
+    uint8_t *held;
+    size_t nheld;
+
+    if ( 0 > c[i].fd || ci[i].conn != job->conn )
+    {
+        DLOG( "Dropping control response for departed c[%d].\n", i );
+        ctl_free( job );
+        return 0;
+    }
+    job->m = NULL;
+    switch ( HDR_GET_TYPE( m ) )
+    {
+    case MSG_TYPE_REGISTER_REQ:
+        if ( 0 == job->res )
+        {
+            mbuf_to_response( &m );
+            mbuf_addattrib( &m, MSG_ATTR_OK, 0, NULL );
+            mbuf_addattrib( &m, MSG_ATTR_NOTICE, sizeof TXT_REGISTERED, TXT_REGISTERED );
+        }
+        else
+            mbuf_to_error_response( &m, job->res );
+        break;
+    case MSG_TYPE_DROP_REQ:
+        if ( 0 == job->res )
+        {
+            mbuf_to_response( &m );
+            mbuf_addattrib( &m, MSG_ATTR_OK, 0, NULL );
+            mbuf_addattrib( &m, MSG_ATTR_NOTICE, sizeof TXT_DROPPED, TXT_DROPPED );
+        }
+        else
+            mbuf_to_error_response( &m, job->res );
+        break;
+    case MSG_TYPE_LOGIN_REQ:
+        DIR_WRLOCK();
+        if ( NULL != ci[i].name )
+        {   /* Left over from a failed authentication. */
+            pdir_del( i );
+            free( ci[i].name ); ci[i].name = NULL;
+            free( ci[i].key ); ci[i].key = NULL;
+        }
+        if ( NULL == job->key )
+        {   /* Login as unregistered user. */
+            if ( 0 <= pdir_byname( job->name, -1 ) )
+            {   /* Name already in use. */
+                mbuf_to_error_response( &m, SC_CONFLICT );
+            }
+            else
             {
-                --nset;
-                accept_client( clients, listenfd, &maxfd, &m_rfds );
+                c[i].id = job->id;
+                c[i].st = CLT_AUTH_OK;
+                ci[i].name = job->name; job->name = NULL;
+                ci[i].key = NULL;
+                pdir_add( i, c[i].id, ci[i].name );
+                peer_joined( c, i, sh );
+                mbuf_to_response( &m );
+                mbuf_addattrib( &m, MSG_ATTR_OK, 0, NULL );
+                mbuf_addattrib( &m, MSG_ATTR_NOTICE, strlen( motd ) + 1, motd );
             }
-#ifdef DEBUG
-            if ( 0 < nset && FD_ISSET( STDIN_FILENO, &rfds ) )
+        }
+        else
+        {   /* Registered user: send challenge. */
+            c[i].st = CLT_LOGIN_OK;
+            c[i].id = job->id;
+            ci[i].name = job->name; job->name = NULL;
+            pdir_add( i, c[i].id, ci[i].name );
+            /* PROOF OF CONCEPT ONLY (road works ahead): */
+            if ( 0 == strncmp( job->key, AUTH_KEY_PLAINTEXT, strlen( AUTH_KEY_PLAINTEXT ) ) )
+            {
+                ci[i].key = job->key; job->key = NULL;
+                mbuf_to_response( &m );
+                mbuf_addattrib( &m, MSG_ATTR_CHALLENGE, strlen( AUTH_KEY_PLAINTEXT ) + 1, AUTH_KEY_PLAINTEXT );
+            }
+            else
+                mbuf_to_error_response( &m, SC_METHOD_NOT_ALLOWED );
+        }
+        DIR_UNLOCK();
+        break;
+    case MSG_TYPE_AUTH_REQ:
+        DIR_WRLOCK();
+        if ( 0 != job->res )
+        {
+            c[i].st = CLT_PRE_LOGIN;
+            DIR_UNLOCK();
+            mbuf_to_error_response( &m, job->res );
+            break;
+        }
+        /* Evict duplicate sessions, which may belong to other shards. */
+        for ( int k = pdir_byid( c[i].id, -1 ); 0 <= k; k = pdir_byid( c[i].id, k ) )
+            if ( i != k )
+                kick_client( k, c[k].id );
+        c[i].st = CLT_AUTH_OK;
+        peer_joined( c, i, sh );
+        mbuf_to_response( &m );
+        mbuf_addattrib( &m, MSG_ATTR_OK, 0, NULL );
+        mbuf_addattrib( &m, MSG_ATTR_NOTICE, strlen( motd ) + 1, motd );
+        DIR_UNLOCK();
+        break;
+    default:
+        break;
+    }
+    ctl_free( job );
+    ci[i].ctl = 0;
+    enqueue_msg( &c[i], m, sh );
+    throttle( c, i, i, sh );
+    /* Resume with the input held back. */
+    held = ci[i].held;
+    nheld = ci[i].nheld;
+    ci[i].held = NULL;
+    ci[i].nheld = 0;
+    if ( 0 < nheld )
+        client_dispatch( c, i, held, nheld, sh );
+    free( held );
+    if ( 0 > c[i].fd )
+        return 0;
+    client_arm_timer( &c[i], sh );
+    client_arm_send( &c[i], sh );
+    return client_arm_recv( &c[i], sh );
+}
+
+
+/* Reactor loop, run by each shard for the slots it owns. */
+static void *shard_run( void *arg )
+{
+    shard_t *sh = arg;
+    client_t *clients = sh->c;
+    int running = 1;
+    time_t last_stats = MONOTIME();
+    ntime_t woke = nclock_get();
+    poller_event_t evs[MAX_EVENTS];
+
+    while ( running )
+    {
+        time_t now, next;
+        int nev, timeout = -1, stalled = 0;
+
+        now = MONOTIME();
+        if ( 0 < sh->nstalled )
+            stalled = unthrottle( clients, sh, now );
+        if ( sh->paused && !overloaded() )
+            accept_pause( sh, 0 );
+        upkeep( clients, sh, now );
+        if ( NULL != sh->graves )
+            zc_reap_graves( sh, now );
+        if ( NULL != __atomic_load_n( &presence, __ATOMIC_RELAXED ) )
+        {   /* Push presence changes before going to sleep. */
+            DIR_WRLOCK();
+            presence_flush( clients, sh );
+            DIR_UNLOCK();
+        }
+        next = twheel_next( sh->tw );
+        if ( 0 == sh->idx && 0 < cfg.stats_interval )
+        {   /* The first shard also logs statistics, if so configured. */
+            if ( now - last_stats >= cfg.stats_interval )
             {
-                --nset;
-                if ( 0 == drain_fd( STDIN_FILENO ) )
-                    break;  /* EOF on stdin terminates server. */
+                last_stats = now;
+                log_stats();
             }
+            if ( 0 > next || next > last_stats + cfg.stats_interval )
+                next = last_stats + cfg.stats_interval;
+        }
+        /* Sleep until the next deadline, unless output is pending. */
+        if ( 0 <= next )
+            timeout = next > now ? (int)( next - now ) * 1000 : 0;
+        if ( 0 < stalled && ( 0 > timeout || STALL_CHECK_MS < timeout ) )
+            timeout = STALL_CHECK_MS;
+        if ( NULL != sh->graves && ( 0 > timeout || ZC_REAP_MS < timeout ) )
+            timeout = ZC_REAP_MS;
+        /* Track the time taken per iteration; while above the limit,
+         * keep iterating so an idle shard is noticed to have caught up. */
+        __atomic_store_n( &sh->lag, ( 3 * sh->lag + nclock_get() - woke ) / 4,
+                            __ATOMIC_RELAXED );
+        if ( ( sh->paused || ( 0 < cfg.admit_max_lag
+                                && sh->lag > ntime_from_ms( cfg.admit_max_lag ) ) )
+            && ( 0 > timeout || ADMIT_CHECK_MS < timeout ) )
+            timeout = ADMIT_CHECK_MS;
+        if ( 0 < sh->nready )
+            timeout = 0;
+        nev = poller_wait( sh->pl, evs, MAX_EVENTS, timeout );
+        woke = nclock_get();
+        if ( 0 < nev )
+        {
+            /* DLOG( "%d fds ready.\n", nev ); */
+            handle_io( clients, sh, evs, nev );
+            for ( int e = 0; e < nev; ++e )
+            {
+                if ( TAG_LISTEN == evs[e].tag )
+                {   /* Accept a bounded number of pending connections,
+                     * unless overloaded. */
+                    if ( overloaded() )
+                        accept_pause( sh, 1 );
+                    else
+                    {
+                        for ( int n = 0; n < ACCEPT_BATCH; ++n )
+                            if ( 0 > accept_client( clients, sh->lfd, sh ) )
+                                break;
+                    }
+                }
+                else if ( TAG_WAKE == evs[e].tag )
+                    drain_mailbox( clients, sh );
+#ifdef DEBUG
+                else if ( TAG_STDIN == evs[e].tag )
+                {
+                    if ( 0 == drain_fd( STDIN_FILENO ) )
+                        running = 0;  /* EOF on stdin terminates server. */
+                }
 #endif
-            if ( 0 < nset ) /* Can happen on read errors. */
-                XLOG( LOG_INFO, "%d file descriptors still set!\n", nset );
+            }
         }
-        else if ( 0 == nset )
+        else if ( 0 == nev )
         {
-            /* DLOG( "select timed out.\n" ); */
+            /* DLOG( "poller_wait() timed out.\n" ); */
         }
         else if ( EINTR == errno )
         {
-            DLOG( "select() was interrupted: %m.\n" );
+            DLOG( "poller_wait() was interrupted: %m.\n" );
         }
         else
         {   /* FATAL ERRORS: */
             /* Unable to allocate memory for internal tables. */
-            die_if( ENOMEM == errno, "select failed: %m.\n" );
+            die_if( ENOMEM == errno, "poller_wait() failed: %m.\n" );
             /* An invalid file descriptor was given in one of the sets.
                (Perhaps a file descriptor that was already closed,
                or one on which an error has occurred.) */
-            die_if( EBADF == errno,  "select failed: %m.\n" );
+            die_if( EBADF == errno,  "poller_wait() failed: %m.\n" );
             /* nfds is negative or exceeds the RLIMIT_NOFILE resource
                limit (see getrlimit(2)), or the value contained within
                timeout is invalid. */
-            die_if( EINVAL == errno, "select failed: %m.\n" );
+            die_if( EINVAL == errno, "poller_wait() failed: %m.\n" );
             /* This should never happen! */
-            die_if( 1, "unhandled error in select(): %m (%d).\n", errno );
+            die_if( 1, "unhandled error in poller_wait(): %m (%d).\n", errno );
         }
+        sched_run( clients, sh );
+    }
+    return NULL;
+}
+
+int main( int argc, char *argv[] )
+{
+    client_t *clients;
+
+    /* Initialization. */
+    die_if( 0 == getuid() || 0 == geteuid() || 0 == getgid() || 0 == getegid(),
+        "%s started with root privileges, aborting!\n", argv[0] );
+    signal( SIGPIPE, SIG_IGN );     /* Ceci n'est pas une pipe. */
+    /* TODO: gracefully handle termination signals (SIGINT, SIGQUIT, SIGTERM)? */
+    XLOG_INIT( argv[0], LOG_TO_SYSLOG|LOG_TO_FILE, stderr );
+    init_config( argc, argv );
+    udb_init( cfg.userdb_path );
+
+    /* Bring up the server. */
+    init_server( &clients );
+#ifdef DEBUG
+    if ( 0 != poller_add( shards[0].pl, STDIN_FILENO, TAG_STDIN, POLLER_IN ) )
+        XLOG( LOG_WARNING, "Unable to watch stdin: %m.\n" );
+#endif
+    DLOG( "Entering main loop.\n" );
+    puts( "" ); /* May serve as a "service ready" signal for a supervisor. */
+    /* The control plane and the MOTD get a thread of their own each, the
+     * first shard is run by the main thread. */
+    errno = pthread_create( &ctl_tid, NULL, ctl_run, NULL );
+    die_if( 0 != errno, "pthread_create() failed: %m.\n" );
+    errno = pthread_create( &motd_tid, NULL, motd_run, NULL );
+    die_if( 0 != errno, "pthread_create() failed: %m.\n" );
+    for ( int k = 1; k < nshards; ++k )
+    {
+        errno = pthread_create( &shards[k].tid, NULL, shard_run, &shards[k] );
+        die_if( 0 != errno, "pthread_create() failed: %m.\n" );
     }
+    shard_run( &shards[0] );
     /* Never reached during normal (non-debug) operation. */
     XLOG( LOG_INFO, "Terminating.\n" );
     exit( EXIT_SUCCESS );
@@ -0,0 +1,207 @@
+/*
+ * srvpeers.c
+ *
+ * Copyright 2016 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <stricmp.h>
+
+#include "srvpeers.h"
+#include "util.h"
+
+
+/* Per-slot index entry, chained into one id and one name bucket. */
+typedef
+    struct {
+        uint64_t id;
+        const char *name;   /* NULL for unused slots */
+        int idnext;         /* next slot in id bucket, or -1 */
+        int namenext;       /* next slot in name bucket, or -1 */
+    }
+    pdir_ent_t;
+
+static pdir_ent_t *ent = NULL;
+static int nent = 0;
+static int *idtab = NULL;       /* id bucket heads */
+static int *nametab = NULL;     /* name bucket heads */
+static unsigned tabmask = 0;
+static int *order = NULL;       /* slots sorted by case-folded name */
+static int norder = 0;
+
+
+static unsigned hash_id( uint64_t id )
+{
+    id ^= id >> 33;
+    id *= 0xff51afd7ed558ccdULL;
+    id ^= id >> 33;
+    return (unsigned)id & tabmask;
+}
+
+static unsigned hash_name( const char *s )
+{
+    uint32_t h = 2166136261U;   /* FNV-1a, case-folded */
+
+    while ( *s )
+    {
+        h ^= (unsigned char)tolower( (unsigned char)*s++ );
+        h *= 16777619U;
+    }
+    return h & tabmask;
+}
+
+/* Compare the (name, slot) key to the entry at the given sorted position. */
+static int cmp_key( const char *name, int slot, int pos )
+{
+    int r = stricmp( name, ent[order[pos]].name );
+
+    return 0 != r ? r : slot - order[pos];
+}
+
+/* Find the first sorted position with an entry not less than the key. */
+static int lower_bound( const char *name, int slot )
+{
+    int lo = 0, hi = norder;
+
+    while ( lo < hi )
+    {
+        int mid = lo + ( hi - lo ) / 2;
+        if ( 0 < cmp_key( name, slot, mid ) )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int pdir_init( int nslots )
+{
+    unsigned n = 16;
+
+    while ( n < (unsigned)nslots )
+        n <<= 1;
+    tabmask = n - 1;
+    free( ent );
+    free( idtab );
+    free( nametab );
+    free( order );
+    nent = nslots;
+    norder = 0;
+    ent = malloc_s( nent * sizeof *ent );
+    order = malloc_s( ( nent + 1 ) * sizeof *order );
+    idtab = malloc_s( n * sizeof *idtab );
+    nametab = malloc_s( n * sizeof *nametab );
+    memset( ent, 0, nent * sizeof *ent );
+    for ( unsigned i = 0; i < n; ++i )
+        idtab[i] = nametab[i] = -1;
+    return 0;
+}
+
+int pdir_add( int slot, uint64_t id, const char *name )
+{
+    unsigned h;
+    int pos;
+
+    if ( 0 > slot || nent <= slot || NULL == name )
+        return errno = EINVAL, -1;
+    if ( NULL != ent[slot].name )
+        pdir_del( slot );
+    ent[slot].id = id;
+    ent[slot].name = name;
+    h = hash_id( id );
+    ent[slot].idnext = idtab[h];
+    idtab[h] = slot;
+    h = hash_name( name );
+    ent[slot].namenext = nametab[h];
+    nametab[h] = slot;
+    pos = lower_bound( name, slot );
+    memmove( order + pos + 1, order + pos, ( norder - pos ) * sizeof *order );
+    order[pos] = slot;
+    ++norder;
+    return 0;
+}
+
+int pdir_del( int slot )
+{
+    int *pp, pos;
+
+    if ( 0 > slot || nent <= slot || NULL == ent[slot].name )
+        return errno = ENOENT, -1;
+    for ( pp = &idtab[hash_id( ent[slot].id )]; *pp != slot; pp = &ent[*pp].idnext )
+        continue;
+    *pp = ent[slot].idnext;
+    for ( pp = &nametab[hash_name( ent[slot].name )]; *pp != slot; pp = &ent[*pp].namenext )
+        continue;
+    *pp = ent[slot].namenext;
+    pos = lower_bound( ent[slot].name, slot );
+    memmove( order + pos, order + pos + 1, ( norder - pos - 1 ) * sizeof *order );
+    --norder;
+    memset( &ent[slot], 0, sizeof ent[slot] );
+    return 0;
+}
+
+int pdir_byid( uint64_t id, int after )
+{
+    int i = ( 0 > after ) ? idtab[hash_id( id )] : ent[after].idnext;
+
+    while ( 0 <= i && ent[i].id != id )
+        i = ent[i].idnext;
+    return i;
+}
+
+int pdir_byname( const char *name, int after )
+{
+    int i = ( 0 > after ) ? nametab[hash_name( name )] : ent[after].namenext;
+
+    while ( 0 <= i && 0 != stricmp( ent[i].name, name ) )
+        i = ent[i].namenext;
+    return i;
+}
+
+int pdir_seek( const char *name, int after )
+{
+    if ( NULL == name )
+        return 0;
+    return lower_bound( name, after ? nent : -1 );
+}
+
+int pdir_slotat( int pos )
+{
+    return ( 0 <= pos && pos < norder ) ? order[pos] : -1;
+}
+
+
+/* EOF */
@@ -0,0 +1,68 @@
+/*
+ * srvpeers.h
+ *
+ * Copyright 2016 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ */
+
+
+#ifndef SRVPEERS_H_INCLUDED
+#define SRVPEERS_H_INCLUDED
+
+#include <stdint.h>
+
+
+/* Peer directory index, mapping peer ids and case-folded peer names
+ * to client slots. Several slots may share an id or name, e.g. while
+ * a duplicate session is being evicted. Names are referenced, not
+ * copied, and must stay valid until the slot is removed. The caller
+ * is responsible for serializing access. */
+
+extern int pdir_init( int nslots );
+extern int pdir_add( int slot, uint64_t id, const char *name );
+extern int pdir_del( int slot );
+
+/* Return the first slot or the next slot after the given one that
+ * matches id or name, or -1 if there is none. */
+extern int pdir_byid( uint64_t id, int after );
+extern int pdir_byname( const char *name, int after );
+
+/* Walk the slots in case-folded name order: pdir_seek() returns the
+ * position of the first entry whose name is not less than (or, with
+ * after set, greater than) the given one, and pdir_slotat() the slot
+ * at a position, or -1 past the end. Positions are only valid until
+ * the next modification. */
+extern int pdir_seek( const char *name, int after );
+extern int pdir_slotat( int pos );
+
+
+#endif /* ndef _H_INCLUDED */
+
+/* EOF */
@@ -0,0 +1,747 @@
+/*
+ * srvpoll.c
+ *
+ * Copyright 2016 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+    #define _DEFAULT_SOURCE     /* syscall */
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#ifndef FD_COPY
+    /* According to POSIX fd_set is a structure type! */
+    #define FD_COPY(dst,src) (*(dst)=*(src))
+#endif
+#ifdef __linux__
+    #define HAVE_EPOLL
+    #include <sys/epoll.h>
+    #include <linux/io_uring.h>
+    #ifdef IORING_SETUP_SINGLE_ISSUER   /* Linux 6.0+ headers */
+        #define HAVE_URING
+        #include <sys/mman.h>
+        #include <sys/syscall.h>
+    #endif
+#endif
+
+#include "srvpoll.h"
+#include "util.h"
+
+
+/* Internal mask bit flagging a registered file descriptor. */
+#define POLLER_REG      0x80
+
+#ifdef HAVE_URING
+/* Submission queue size. */
+#define URING_ENTRIES   1024
+
+/* Operation codes encoded in io_uring user data, next to fd and
+ * generation; also used as in-flight bits in the per-fd busy table. */
+enum URING_OP {
+    UOP_POLL = 1,
+    UOP_RECV = 2,
+    UOP_SEND = 3,
+};
+#define UOP_BIT(op)     (1U << (op))
+#define UOP_DISCARD     0x80    /* drop next receive completion */
+
+#define UD_MAKE(gen,fd,op)  (((uint64_t)(gen) << 32) | ((uint64_t)(fd) << 2) | (op))
+#define UD_GEN(ud)          ((uint32_t)((ud) >> 32))
+#define UD_FD(ud)           ((int)(((ud) >> 2) & 0x3fffffff))
+#define UD_OP(ud)           ((int)((ud) & 3))
+
+/* Per-fd send message, kept stable while a send is in flight. */
+typedef
+    struct {
+        struct msghdr mh;
+        struct iovec iov[POLLER_IOV_MAX];
+    }
+    uring_msg_t;
+#endif
+
+struct POLLER_T_STRUCT {
+    enum POLLER_BACKEND backend;
+    int maxfds;             /* upper (exclusive) limit for file descriptors */
+    int nfds;               /* size of the per-fd tables below */
+    int *tag;               /* per-fd tags */
+    unsigned char *mask;    /* per-fd interest and registration flags */
+    /* select() backend: */
+    fd_set rfds, wfds;
+    int maxfd;
+#ifdef HAVE_EPOLL
+    /* epoll() backend: */
+    int epfd;
+    struct epoll_event *eev;
+    int neev;
+#endif
+#ifdef HAVE_URING
+    /* io_uring backend: */
+    int ringfd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    unsigned sq_pending;    /* queued, but not yet submitted */
+    uint32_t *gen;          /* per-fd generation counters */
+    unsigned char *busy;    /* per-fd in-flight operations */
+    uring_msg_t **msg;      /* per-fd send messages, allocated on demand */
+#endif
+};
+
+
+static int poller_reserve( poller_t *p, int fd )
+{
+    int n = p->nfds;
+
+    if ( 0 > fd || p->maxfds <= fd )
+        return errno = EINVAL, -1;
+    if ( fd < n )
+        return 0;
+    while ( n <= fd )
+        n = n ? n * 2 : 64;
+    if ( n > p->maxfds )
+        n = p->maxfds;
+    p->tag = realloc_s( p->tag, n * sizeof *p->tag );
+    p->mask = realloc_s( p->mask, n * sizeof *p->mask );
+    memset( p->mask + p->nfds, 0, ( n - p->nfds ) * sizeof *p->mask );
+#ifdef HAVE_URING
+    if ( POLLER_URING == p->backend )
+    {
+        p->gen = realloc_s( p->gen, n * sizeof *p->gen );
+        p->busy = realloc_s( p->busy, n * sizeof *p->busy );
+        p->msg = realloc_s( p->msg, n * sizeof *p->msg );
+        memset( p->gen + p->nfds, 0, ( n - p->nfds ) * sizeof *p->gen );
+        memset( p->busy + p->nfds, 0, ( n - p->nfds ) * sizeof *p->busy );
+        memset( p->msg + p->nfds, 0, ( n - p->nfds ) * sizeof *p->msg );
+    }
+#endif
+    p->nfds = n;
+    return 0;
+}
+
+#ifdef HAVE_EPOLL
+static int epoll_ctl_( poller_t *p, int op, int fd, unsigned ev )
+{
+    struct epoll_event e;
+
+    memset( &e, 0, sizeof e );
+    e.events = ( ev & POLLER_IN ? EPOLLIN : 0 ) | ( ev & POLLER_OUT ? EPOLLOUT : 0 );
+    e.data.fd = fd;
+    return epoll_ctl( p->epfd, op, fd, &e );
+}
+#endif
+
+#ifdef HAVE_URING
+static int uring_enter( poller_t *p, unsigned to_submit, unsigned min_complete,
+                        unsigned flags, const void *arg, size_t argsz )
+{
+    int r = syscall( __NR_io_uring_enter, p->ringfd, to_submit, min_complete,
+                     flags, arg, argsz );
+    if ( 0 < r )
+        p->sq_pending -= (unsigned)r < p->sq_pending ? (unsigned)r : p->sq_pending;
+    return r;
+}
+
+static int uring_flush( poller_t *p )
+{
+    while ( 0 < p->sq_pending )
+    {
+        if ( 0 > uring_enter( p, p->sq_pending, 0, 0, NULL, 0 ) && EINTR != errno )
+        {
+            XLOG( LOG_ERR, "io_uring_enter() failed: %m.\n" );
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int uring_push( poller_t *p, int op, int fd,
+                        const void *buf, size_t len, int flags )
+{
+    unsigned tail = *p->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    if ( tail - __atomic_load_n( p->sq_head, __ATOMIC_ACQUIRE ) >= p->sq_entries )
+    {   /* Submission queue full, hand over what we have. */
+        if ( 0 != uring_flush( p ) )
+            return -1;
+    }
+    sqe = &p->sqes[tail & p->sq_mask];
+    memset( sqe, 0, sizeof *sqe );
+    sqe->fd = fd;
+    sqe->user_data = UD_MAKE( p->gen[fd], fd, op );
+    switch ( op )
+    {
+    case UOP_POLL:
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+        break;
+    case UOP_RECV:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->addr = (uintptr_t)buf;
+        sqe->len = len;
+        break;
+    case UOP_SEND:
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = (uintptr_t)buf;     /* struct msghdr */
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | flags;
+        break;
+    default:
+        break;
+    }
+    p->sq_array[tail & p->sq_mask] = tail & p->sq_mask;
+    __atomic_store_n( p->sq_tail, tail + 1, __ATOMIC_RELEASE );
+    ++p->sq_pending;
+    p->busy[fd] |= UOP_BIT( op );
+    return 0;
+}
+
+/* Synchronously cancel in-flight operations, either all of them on the
+ * given fd (ud == 0), or the one identified by user data ud. */
+static int uring_cancel( poller_t *p, int fd, uint64_t ud )
+{
+    struct io_uring_sync_cancel_reg reg;
+    int r;
+
+    if ( 0 != uring_flush( p ) )
+        return -1;
+    memset( &reg, 0, sizeof reg );
+    if ( 0 == ud )
+    {
+        reg.fd = fd;
+        reg.flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+    else
+        reg.addr = ud;
+    reg.timeout.tv_sec = -1;
+    reg.timeout.tv_nsec = -1;
+    do
+        r = syscall( __NR_io_uring_register, p->ringfd,
+                     IORING_REGISTER_SYNC_CANCEL, &reg, 1 );
+    while ( 0 > r && EINTR == errno );
+    if ( 0 > r && ENOENT != errno )
+    {
+        XLOG( LOG_ERR, "io_uring sync cancel failed: %m.\n" );
+        return -1;
+    }
+    return 0;
+}
+
+static int uring_init( poller_t *p )
+{
+    struct io_uring_params par;
+    struct io_uring_sync_cancel_reg reg;
+    uint8_t *sq, *cq;
+
+    memset( &par, 0, sizeof par );
+    p->ringfd = syscall( __NR_io_uring_setup, URING_ENTRIES, &par );
+    if ( 0 > p->ringfd )
+        return -1;
+    if ( !( par.features & IORING_FEAT_SINGLE_MMAP )
+        || !( par.features & IORING_FEAT_NODROP )
+        || !( par.features & IORING_FEAT_EXT_ARG ) )
+    {
+        close( p->ringfd );
+        return errno = ENOSYS, -1;
+    }
+    p->sq_ring_sz = par.sq_off.array + par.sq_entries * sizeof( unsigned );
+    p->cq_ring_sz = par.cq_off.cqes + par.cq_entries * sizeof( struct io_uring_cqe );
+    if ( p->cq_ring_sz > p->sq_ring_sz )
+        p->sq_ring_sz = p->cq_ring_sz;
+    p->sq_ring = mmap( NULL, p->sq_ring_sz, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, p->ringfd, IORING_OFF_SQ_RING );
+    if ( MAP_FAILED == p->sq_ring )
+    {
+        close( p->ringfd );
+        return -1;
+    }
+    p->cq_ring = p->sq_ring;
+    p->sqes = mmap( NULL, par.sq_entries * sizeof *p->sqes, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, p->ringfd, IORING_OFF_SQES );
+    if ( MAP_FAILED == p->sqes )
+    {
+        munmap( p->sq_ring, p->sq_ring_sz );
+        close( p->ringfd );
+        return -1;
+    }
+    sq = p->sq_ring;
+    cq = p->cq_ring;
+    p->sq_head = (unsigned *)( sq + par.sq_off.head );
+    p->sq_tail = (unsigned *)( sq + par.sq_off.tail );
+    p->sq_array = (unsigned *)( sq + par.sq_off.array );
+    p->sq_mask = *(unsigned *)( sq + par.sq_off.ring_mask );
+    p->sq_entries = *(unsigned *)( sq + par.sq_off.ring_entries );
+    p->cq_head = (unsigned *)( cq + par.cq_off.head );
+    p->cq_tail = (unsigned *)( cq + par.cq_off.tail );
+    p->cq_mask = *(unsigned *)( cq + par.cq_off.ring_mask );
+    p->cqes = (struct io_uring_cqe *)( cq + par.cq_off.cqes );
+    /* Probe for synchronous cancellation, we cannot do without. */
+    memset( &reg, 0, sizeof reg );
+    reg.fd = p->ringfd;
+    reg.flags = IORING_ASYNC_CANCEL_FD;
+    if ( 0 == syscall( __NR_io_uring_register, p->ringfd,
+                       IORING_REGISTER_SYNC_CANCEL, &reg, 1 ) || ENOENT != errno )
+    {
+        munmap( p->sqes, par.sq_entries * sizeof *p->sqes );
+        munmap( p->sq_ring, p->sq_ring_sz );
+        close( p->ringfd );
+        return errno = ENOSYS, -1;
+    }
+    p->backend = POLLER_URING;
+    return 0;
+}
+#endif
+
+poller_t *poller_new( const char *backend, int maxfds )
+{
+    poller_t *p;
+
+    p = malloc_s( sizeof *p );
+    memset( p, 0, sizeof *p );
+    p->backend = POLLER_SELECT;
+    p->maxfd = -1;
+    if ( NULL != backend && 0 == strcmp( backend, "uring" ) )
+    {
+#ifdef HAVE_URING
+        if ( 0 != uring_init( p ) )
+            XLOG( LOG_WARNING, "io_uring setup failed: %m, falling back.\n" );
+#else
+        XLOG( LOG_WARNING, "io_uring not supported on this system, falling back.\n" );
+#endif
+        if ( POLLER_URING != p->backend )
+            backend = "epoll";
+    }
+    if ( NULL != backend && 0 == strcmp( backend, "epoll" ) )
+    {
+#ifdef HAVE_EPOLL
+        if ( 0 <= ( p->epfd = epoll_create1( EPOLL_CLOEXEC ) ) )
+            p->backend = POLLER_EPOLL;
+        else
+            XLOG( LOG_WARNING, "epoll_create1() failed: %m, using select().\n" );
+#else
+        XLOG( LOG_WARNING, "epoll not supported on this system, using select().\n" );
+#endif
+    }
+    else if ( NULL != backend && 0 != strcmp( backend, "select" )
+            && 0 != strcmp( backend, "uring" ) )
+        XLOG( LOG_WARNING, "Unknown event backend '%s', using select().\n", backend );
+    if ( POLLER_SELECT == p->backend )
+    {
+        if ( (int)FD_SETSIZE < maxfds )
+            maxfds = FD_SETSIZE;
+        FD_ZERO( &p->rfds );
+        FD_ZERO( &p->wfds );
+    }
+    p->maxfds = maxfds;
+    DLOG( "Using %s event backend for up to %d fds.\n", poller_name( p ), maxfds );
+    return p;
+}
+
+void poller_free( poller_t **pp )
+{
+    poller_t *p = *pp;
+
+    if ( NULL == p )
+        return;
+#ifdef HAVE_EPOLL
+    if ( POLLER_EPOLL == p->backend )
+        close( p->epfd );
+    free( p->eev );
+#endif
+#ifdef HAVE_URING
+    if ( POLLER_URING == p->backend )
+    {
+        munmap( p->sqes, p->sq_entries * sizeof *p->sqes );
+        munmap( p->sq_ring, p->sq_ring_sz );
+        close( p->ringfd );
+    }
+    for ( int fd = 0; NULL != p->msg && fd < p->nfds; ++fd )
+        free( p->msg[fd] );
+    free( p->msg );
+    free( p->gen );
+    free( p->busy );
+#endif
+    free( p->tag );
+    free( p->mask );
+    free( p );
+    *pp = NULL;
+}
+
+const char *poller_name( const poller_t *p )
+{
+    switch ( p->backend )
+    {
+    case POLLER_SELECT: return "select";  break;
+    case POLLER_EPOLL:  return "epoll";   break;
+    case POLLER_URING:  return "uring";   break;
+    default:
+        break;
+    }
+    return "unknown";
+}
+
+int poller_maxfds( const poller_t *p )
+{
+    return p->maxfds;
+}
+
+int poller_is_async( const poller_t *p )
+{
+    return POLLER_URING == p->backend;
+}
+
+int poller_add( poller_t *p, int fd, int tag, unsigned ev )
+{
+    if ( 0 != poller_reserve( p, fd ) )
+        return -1;
+    if ( p->mask[fd] & POLLER_REG )
+        return errno = EEXIST, -1;
+#ifdef HAVE_EPOLL
+    if ( POLLER_EPOLL == p->backend && 0 != epoll_ctl_( p, EPOLL_CTL_ADD, fd, ev ) )
+        return -1;
+#endif
+    p->tag[fd] = tag;
+    p->mask[fd] = POLLER_REG;
+    if ( POLLER_SELECT == p->backend && fd > p->maxfd )
+        p->maxfd = fd;
+    return poller_set( p, fd, ev );
+}
+
+int poller_set( poller_t *p, int fd, unsigned ev )
+{
+    unsigned old;
+
+    if ( 0 > fd || p->nfds <= fd || !( p->mask[fd] & POLLER_REG ) )
+        return errno = EBADF, -1;
+    ev &= POLLER_IN | POLLER_OUT;
+    old = p->mask[fd] & ~POLLER_REG;
+    if ( ev == old )
+        return 0;
+    switch ( p->backend )
+    {
+#ifdef HAVE_EPOLL
+    case POLLER_EPOLL:
+        if ( 0 != epoll_ctl_( p, EPOLL_CTL_MOD, fd, ev ) )
+            return -1;
+        break;
+#endif
+#ifdef HAVE_URING
+    case POLLER_URING:
+        /* Readiness is only supported for input, via one-shot polls
+         * re-armed after each report. Output interest is ignored. */
+        if ( ( ev & POLLER_IN ) && !( p->busy[fd] & UOP_BIT( UOP_POLL ) )
+            && 0 != uring_push( p, UOP_POLL, fd, NULL, 0, 0 ) )
+            return -1;
+        break;
+#endif
+    case POLLER_SELECT:
+    default:
+        if ( ev & POLLER_IN )
+            FD_SET( fd, &p->rfds );
+        else
+            FD_CLR( fd, &p->rfds );
+        if ( ev & POLLER_OUT )
+            FD_SET( fd, &p->wfds );
+        else
+            FD_CLR( fd, &p->wfds );
+        break;
+    }
+    p->mask[fd] = POLLER_REG | ev;
+    return 0;
+}
+
+int poller_del( poller_t *p, int fd )
+{
+    if ( 0 > fd || p->nfds <= fd || !( p->mask[fd] & POLLER_REG ) )
+        return errno = EBADF, -1;
+    switch ( p->backend )
+    {
+#ifdef HAVE_EPOLL
+    case POLLER_EPOLL:
+        epoll_ctl_( p, EPOLL_CTL_DEL, fd, 0 );
+        break;
+#endif
+#ifdef HAVE_URING
+    case POLLER_URING:
+        /* Make sure the kernel is done with any buffers before the
+         * caller gets a chance to release them, then make any stale
+         * completions still in the ring unrecognizable. */
+        if ( p->busy[fd] )
+            uring_cancel( p, fd, 0 );
+        p->busy[fd] = 0;
+        ++p->gen[fd];
+        break;
+#endif
+    case POLLER_SELECT:
+    default:
+        FD_CLR( fd, &p->rfds );
+        FD_CLR( fd, &p->wfds );
+        break;
+    }
+    p->mask[fd] = 0;
+    if ( POLLER_SELECT == p->backend )
+        while ( 0 <= p->maxfd && !( p->mask[p->maxfd] & POLLER_REG ) )
+            --p->maxfd;
+    return 0;
+}
+
+static int poller_wait_select( poller_t *p, poller_event_t *evs, int maxev, int timeout_ms )
+{
+    int nset, n = 0;
+    fd_set rfds, wfds;
+    struct timeval to, *pto = NULL;
+
+    if ( 0 <= timeout_ms )
+    {
+        to.tv_sec = timeout_ms / 1000;
+        to.tv_usec = timeout_ms % 1000 * 1000;
+        pto = &to;
+    }
+    FD_COPY( &rfds, &p->rfds );
+    FD_COPY( &wfds, &p->wfds );
+    nset = select( p->maxfd + 1, &rfds, &wfds, NULL, pto );
+    if ( 0 >= nset )
+        return nset;
+    for ( int fd = 0; fd <= p->maxfd && n < maxev && 0 < nset; ++fd )
+    {
+        unsigned ev = 0;
+        if ( FD_ISSET( fd, &rfds ) )
+            ev |= POLLER_IN, --nset;
+        if ( FD_ISSET( fd, &wfds ) )
+            ev |= POLLER_OUT, --nset;
+        if ( ev )
+        {
+            evs[n].fd = fd;
+            evs[n].tag = p->tag[fd];
+            evs[n].ev = ev;
+            ++n;
+        }
+    }
+    return n;
+}
+
+#ifdef HAVE_EPOLL
+static int poller_wait_epoll( poller_t *p, poller_event_t *evs, int maxev, int timeout_ms )
+{
+    int nset;
+
+    if ( p->neev < maxev )
+    {
+        p->eev = realloc_s( p->eev, maxev * sizeof *p->eev );
+        p->neev = maxev;
+    }
+    nset = epoll_wait( p->epfd, p->eev, maxev, timeout_ms );
+    for ( int i = 0; i < nset; ++i )
+    {
+        unsigned e = p->eev[i].events;
+        int fd = p->eev[i].data.fd;
+        evs[i].fd = fd;
+        evs[i].tag = p->tag[fd];
+        /* Hangups are picked up by the next read(). */
+        evs[i].ev = ( e & ( EPOLLIN | EPOLLHUP ) ? POLLER_IN : 0 )
+                  | ( e & EPOLLOUT ? POLLER_OUT : 0 )
+                  | ( e & EPOLLERR ? POLLER_ERR : 0 );
+    }
+    return nset;
+}
+#endif
+
+#ifdef HAVE_URING
+static int poller_wait_uring( poller_t *p, poller_event_t *evs, int maxev, int timeout_ms )
+{
+    unsigned head = *p->cq_head;
+    int n = 0;
+
+    if ( head == __atomic_load_n( p->cq_tail, __ATOMIC_ACQUIRE ) )
+    {   /* Submit everything queued and wait for completions. */
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+
+        memset( &arg, 0, sizeof arg );
+        if ( 0 <= timeout_ms )
+        {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = timeout_ms % 1000 * 1000000L;
+            arg.ts = (uintptr_t)&ts;
+        }
+        if ( 0 > uring_enter( p, p->sq_pending, 1,
+                        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                        &arg, sizeof arg ) )
+        {
+            if ( ETIME == errno )
+                return 0;
+            if ( EBUSY != errno && EAGAIN != errno )
+                return -1;
+        }
+    }
+    else if ( 0 != uring_flush( p ) )
+        return -1;
+    while ( n < maxev && head != __atomic_load_n( p->cq_tail, __ATOMIC_ACQUIRE ) )
+    {
+        struct io_uring_cqe *cqe = &p->cqes[head & p->cq_mask];
+        uint64_t ud = cqe->user_data;
+        int fd = UD_FD( ud ), op = UD_OP( ud );
+
+        ++head;
+        if ( p->nfds <= fd || UD_GEN( ud ) != p->gen[fd]
+            || !( p->mask[fd] & POLLER_REG ) )
+            continue;   /* Stale completion for an unregistered fd. */
+        if ( UOP_RECV == op && ( p->busy[fd] & UOP_DISCARD ) )
+        {   /* Completion of a canceled receive; its busy bit was cleared
+             * on cancellation and may belong to a new receive by now. */
+            p->busy[fd] &= ~UOP_DISCARD;
+            continue;
+        }
+        p->busy[fd] &= ~UOP_BIT( op );
+        evs[n].fd = fd;
+        evs[n].tag = p->tag[fd];
+        evs[n].res = cqe->res;
+        switch ( op )
+        {
+        case UOP_POLL:
+            evs[n].ev = POLLER_IN;
+            /* Re-arm, will fire again right away if still readable. */
+            if ( p->mask[fd] & POLLER_IN )
+                uring_push( p, UOP_POLL, fd, NULL, 0, 0 );
+            break;
+        case UOP_RECV:
+            evs[n].ev = POLLER_RECV;
+            break;
+        case UOP_SEND:
+            evs[n].ev = POLLER_SEND;
+            break;
+        default:
+            continue;
+            break;
+        }
+        ++n;
+    }
+    __atomic_store_n( p->cq_head, head, __ATOMIC_RELEASE );
+    return n;
+}
+#endif
+
+int poller_wait( poller_t *p, poller_event_t *evs, int maxev, int timeout_ms )
+{
+    switch ( p->backend )
+    {
+#ifdef HAVE_EPOLL
+    case POLLER_EPOLL:
+        return poller_wait_epoll( p, evs, maxev, timeout_ms );
+        break;
+#endif
+#ifdef HAVE_URING
+    case POLLER_URING:
+        return poller_wait_uring( p, evs, maxev, timeout_ms );
+        break;
+#endif
+    case POLLER_SELECT:
+    default:
+        break;
+    }
+    return poller_wait_select( p, evs, maxev, timeout_ms );
+}
+
+int poller_recv( poller_t *p, int fd, void *buf, size_t len )
+{
+#ifdef HAVE_URING
+    if ( POLLER_URING == p->backend )
+    {
+        if ( 0 > fd || p->nfds <= fd || !( p->mask[fd] & POLLER_REG ) )
+            return errno = EBADF, -1;
+        if ( p->busy[fd] & UOP_BIT( UOP_RECV ) )
+            return errno = EBUSY, -1;
+        return uring_push( p, UOP_RECV, fd, buf, len, 0 );
+    }
+#endif
+    return errno = ENOSYS, -1;
+    (void)fd; (void)buf; (void)len;
+}
+
+int poller_sendv( poller_t *p, int fd, const struct iovec *iov, int iovcnt, int flags )
+{
+#ifdef HAVE_URING
+    if ( POLLER_URING == p->backend )
+    {
+        uring_msg_t *m;
+
+        if ( 0 > fd || p->nfds <= fd || !( p->mask[fd] & POLLER_REG ) )
+            return errno = EBADF, -1;
+        if ( 0 >= iovcnt || POLLER_IOV_MAX < iovcnt )
+            return errno = EINVAL, -1;
+        if ( p->busy[fd] & UOP_BIT( UOP_SEND ) )
+            return errno = EBUSY, -1;
+        if ( NULL == ( m = p->msg[fd] ) )
+            m = p->msg[fd] = malloc_s( sizeof *m );
+        memset( &m->mh, 0, sizeof m->mh );
+        memcpy( m->iov, iov, iovcnt * sizeof *iov );
+        m->mh.msg_iov = m->iov;
+        m->mh.msg_iovlen = iovcnt;
+        return uring_push( p, UOP_SEND, fd, &m->mh, 0, flags );
+    }
+#endif
+    return errno = ENOSYS, -1;
+    (void)fd; (void)iov; (void)iovcnt; (void)flags;
+}
+
+int poller_cancel( poller_t *p, int fd, unsigned ev )
+{
+#ifdef HAVE_URING
+    if ( POLLER_URING == p->backend )
+    {
+        if ( 0 > fd || p->nfds <= fd || !( p->mask[fd] & POLLER_REG ) )
+            return errno = EBADF, -1;
+        if ( ( ev & POLLER_RECV ) && ( p->busy[fd] & UOP_BIT( UOP_RECV ) ) )
+        {
+            if ( 0 != uring_cancel( p, fd, UD_MAKE( p->gen[fd], fd, UOP_RECV ) ) )
+                return -1;
+            p->busy[fd] &= ~UOP_BIT( UOP_RECV );
+            p->busy[fd] |= UOP_DISCARD;
+        }
+        return 0;
+    }
+#endif
+    return errno = ENOSYS, -1;
+    (void)fd; (void)ev;
+}
+
+/* EOF */
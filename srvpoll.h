@@ -0,0 +1,102 @@
+/*
+ * srvpoll.h
+ *
+ * Copyright 2016 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ */
+
+
+#ifndef SRVPOLL_H_INCLUDED
+#define SRVPOLL_H_INCLUDED
+
+#include <stddef.h>
+
+#include <sys/uio.h>
+
+
+/* Event notification backends. */
+enum POLLER_BACKEND {
+    POLLER_SELECT = 0,
+    POLLER_EPOLL,
+    POLLER_URING,
+};
+
+/* Event flags, used both to express interest and to report readiness. */
+#define POLLER_IN       0x01
+#define POLLER_OUT      0x02
+/* Completion flags, reported by asynchronous backends only. */
+#define POLLER_RECV     0x04
+#define POLLER_SEND     0x08
+/* Error condition, reported by epoll only, apart from POLLER_IN, as it
+ * may merely signal zero-copy send completions. */
+#define POLLER_ERR      0x10
+
+/* Maximum number of iovecs per asynchronous send. */
+#define POLLER_IOV_MAX  64
+
+typedef
+    struct POLLER_T_STRUCT
+    poller_t;
+
+typedef
+    struct {
+        int fd;         /* ready file descriptor */
+        int tag;        /* tag supplied with poller_add() */
+        unsigned ev;    /* POLLER_IN, POLLER_OUT, POLLER_RECV, POLLER_SEND
+                           or POLLER_ERR */
+        int res;        /* bytes transferred or -errno, for completions */
+    }
+    poller_event_t;
+
+
+extern poller_t *poller_new( const char *backend, int maxfds );
+extern void poller_free( poller_t **pp );
+extern const char *poller_name( const poller_t *p );
+extern int poller_maxfds( const poller_t *p );
+extern int poller_is_async( const poller_t *p );
+
+extern int poller_add( poller_t *p, int fd, int tag, unsigned ev );
+extern int poller_set( poller_t *p, int fd, unsigned ev );
+extern int poller_del( poller_t *p, int fd );
+extern int poller_wait( poller_t *p, poller_event_t *evs, int maxev, int timeout_ms );
+
+/* Asynchronous backends only: submit a single receive or send operation
+ * per fd and direction; the buffers must stay valid until the respective
+ * completion is reported, or the operation was canceled. The iovec array
+ * itself is copied, up to POLLER_IOV_MAX entries. Send flags are passed
+ * on as for sendmsg(2). */
+extern int poller_recv( poller_t *p, int fd, void *buf, size_t len );
+extern int poller_sendv( poller_t *p, int fd, const struct iovec *iov, int iovcnt, int flags );
+extern int poller_cancel( poller_t *p, int fd, unsigned ev );
+
+
+#endif /* ndef _H_INCLUDED */
+
+/* EOF */
@@ -0,0 +1,148 @@
+/*
+ * srvsplice.c
+ *
+ * Copyright 2016 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ */
+
+#ifdef __linux__
+    #define _GNU_SOURCE         /* splice, pipe2, F_SETPIPE_SZ */
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "message.h"
+#include "srvsplice.h"
+#include "util.h"
+
+
+/* Empty pipes kept for reuse, per thread. */
+#define SPIPE_CACHE     8
+
+struct SPIPE_T_STRUCT {
+    int fd[2];              /* read and write end */
+    size_t len;             /* bytes held */
+};
+
+#ifdef __linux__
+static __thread spipe_t *cache[SPIPE_CACHE];
+static __thread int ncache = 0;
+#endif
+
+
+spipe_t *spipe_new( void )
+{
+#ifdef __linux__
+    spipe_t *p;
+
+    if ( 0 < ncache )
+        return cache[--ncache];
+    p = malloc_s( sizeof *p );
+    p->len = 0;
+    if ( 0 != pipe2( p->fd, O_NONBLOCK | O_CLOEXEC ) )
+    {
+        free( p );
+        return NULL;
+    }
+    /* Make room for a whole payload's worth of pages. The capacity is
+     * really counted in buffer slots, though, and data spliced from a
+     * socket may fill slots only partially, so the pipe can still fill
+     * up before the payload is in. */
+    if ( MSG_MAX_PAY_SIZE > fcntl( p->fd[1], F_GETPIPE_SZ )
+        && MSG_MAX_PAY_SIZE > fcntl( p->fd[1], F_SETPIPE_SZ, MSG_MAX_PAY_SIZE ) )
+    {
+        close( p->fd[0] );
+        close( p->fd[1] );
+        free( p );
+        return errno = ENOSPC, NULL;
+    }
+    return p;
+#else
+    return errno = ENOSYS, NULL;
+#endif
+}
+
+void spipe_free( spipe_t **pp )
+{
+    spipe_t *p = *pp;
+
+    if ( NULL == p )
+        return;
+#ifdef __linux__
+    if ( 0 == p->len && SPIPE_CACHE > ncache )
+        cache[ncache++] = p;
+    else
+#endif
+    {
+        close( p->fd[0] );
+        close( p->fd[1] );
+        free( p );
+    }
+    *pp = NULL;
+}
+
+size_t spipe_len( const spipe_t *p )
+{
+    return p->len;
+}
+
+ssize_t spipe_fill( spipe_t *p, int fd, size_t len )
+{
+#ifdef __linux__
+    ssize_t r = splice( fd, NULL, p->fd[1], NULL, len,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+    if ( 0 < r )
+        p->len += r;
+    return r;
+#else
+    return errno = ENOSYS, -1;
+    (void)p; (void)fd; (void)len;
+#endif
+}
+
+ssize_t spipe_drain( spipe_t *p, int fd, int more )
+{
+#ifdef __linux__
+    ssize_t w = splice( p->fd[0], NULL, fd, NULL, p->len,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK | ( more ? SPLICE_F_MORE : 0 ) );
+    if ( 0 < w )
+        p->len -= w;
+    return w;
+#else
+    return errno = ENOSYS, -1;
+    (void)p; (void)fd; (void)more;
+#endif
+}
+
+/* EOF */
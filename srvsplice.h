@@ -0,0 +1,67 @@
+/*
+ * srvsplice.h
+ *
+ * Copyright 2016 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ */
+
+#ifndef SRVSPLICE_H_INCLUDED
+#define SRVSPLICE_H_INCLUDED
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/* Kernel pipe used to pass data from one socket to another without
+ * copying it through user space. Only available on Linux; elsewhere
+ * spipe_new() fails with ENOSYS. A pipe always holds at least one
+ * maximum size message payload. */
+typedef
+    struct SPIPE_T_STRUCT
+    spipe_t;
+
+
+extern spipe_t *spipe_new( void );
+extern void spipe_free( spipe_t **pp );
+
+/* Number of bytes currently held in the pipe. */
+extern size_t spipe_len( const spipe_t *p );
+
+/* Move up to len bytes from socket fd into the pipe, or all bytes held
+ * from the pipe to socket fd, hinting at more to follow if more is set.
+ * Both return the number of bytes moved, or -1 with errno set; filling
+ * fails with EAGAIN as well when the pipe is full. */
+extern ssize_t spipe_fill( spipe_t *p, int fd, size_t len );
+extern ssize_t spipe_drain( spipe_t *p, int fd, int more );
+
+
+#endif /* ndef _H_INCLUDED */
+
+/* EOF */
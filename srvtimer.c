@@ -0,0 +1,209 @@
+/*
+ * srvtimer.c
+ *
+ * Copyright 2016 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "srvtimer.h"
+#include "util.h"
+
+
+/* As the span is limited to the wheel size, all timers hashed to a
+ * bucket are due at the same time, except for overdue ones, which are
+ * put in the current bucket. Non-empty buckets are tracked in a bitmap
+ * to quickly find the next due time. */
+struct TWHEEL_T_STRUCT {
+    int nent;
+    int count;              /* number of pending timers */
+    unsigned mask;          /* wheel size - 1 */
+    time_t cur;             /* time of the current bucket */
+    int *head;              /* per-bucket list heads */
+    uint64_t *bits;         /* non-empty bucket bitmap */
+    int *next, *prev;       /* per-entry list links */
+    time_t *due;            /* per-entry due time, 0 if unset */
+};
+
+#define BIT_SET(tw,b)   ((tw)->bits[(b) / 64] |= 1ULL << ((b) % 64))
+#define BIT_CLR(tw,b)   ((tw)->bits[(b) / 64] &= ~(1ULL << ((b) % 64)))
+
+
+twheel_t *twheel_new( int nent, int span, time_t now )
+{
+    twheel_t *tw;
+    unsigned n = 64;
+
+    while ( n <= (unsigned)span )
+        n <<= 1;
+    tw = malloc_s( sizeof *tw );
+    tw->nent = nent;
+    tw->count = 0;
+    tw->mask = n - 1;
+    tw->cur = now;
+    tw->head = malloc_s( n * sizeof *tw->head );
+    tw->bits = malloc_s( n / 64 * sizeof *tw->bits );
+    tw->next = malloc_s( nent * sizeof *tw->next );
+    tw->prev = malloc_s( nent * sizeof *tw->prev );
+    tw->due = malloc_s( nent * sizeof *tw->due );
+    for ( unsigned i = 0; i < n; ++i )
+        tw->head[i] = -1;
+    memset( tw->bits, 0, n / 64 * sizeof *tw->bits );
+    memset( tw->due, 0, nent * sizeof *tw->due );
+    return tw;
+}
+
+void twheel_free( twheel_t **ptw )
+{
+    twheel_t *tw = *ptw;
+
+    if ( NULL == tw )
+        return;
+    free( tw->head );
+    free( tw->bits );
+    free( tw->next );
+    free( tw->prev );
+    free( tw->due );
+    free( tw );
+    *ptw = NULL;
+}
+
+static unsigned twheel_bucket( const twheel_t *tw, time_t due )
+{
+    return (unsigned)( due < tw->cur ? tw->cur : due ) & tw->mask;
+}
+
+int twheel_del( twheel_t *tw, int id )
+{
+    if ( 0 > id || tw->nent <= id )
+        return errno = EINVAL, -1;
+    if ( 0 == tw->due[id] )
+        return 0;
+    if ( 0 <= tw->prev[id] )
+        tw->next[tw->prev[id]] = tw->next[id];
+    else
+    {
+        unsigned b = twheel_bucket( tw, tw->due[id] );
+        tw->head[b] = tw->next[id];
+        if ( 0 > tw->head[b] )
+            BIT_CLR( tw, b );
+    }
+    if ( 0 <= tw->next[id] )
+        tw->prev[tw->next[id]] = tw->prev[id];
+    tw->due[id] = 0;
+    --tw->count;
+    return 0;
+}
+
+int twheel_set( twheel_t *tw, int id, time_t due )
+{
+    unsigned b;
+
+    if ( 0 > id || tw->nent <= id || 0 == due )
+        return errno = EINVAL, -1;
+    twheel_del( tw, id );
+    if ( due > tw->cur + (time_t)tw->mask )
+        due = tw->cur + tw->mask;
+    b = twheel_bucket( tw, due );
+    tw->due[id] = due;
+    tw->prev[id] = -1;
+    tw->next[id] = tw->head[b];
+    if ( 0 <= tw->head[b] )
+        tw->prev[tw->head[b]] = id;
+    tw->head[b] = id;
+    BIT_SET( tw, b );
+    ++tw->count;
+    return 0;
+}
+
+time_t twheel_due( const twheel_t *tw, int id )
+{
+    return ( 0 > id || tw->nent <= id ) ? 0 : tw->due[id];
+}
+
+int twheel_pop( twheel_t *tw, time_t now )
+{
+    if ( 0 == tw->count )
+    {   /* Nothing to walk past. */
+        if ( tw->cur < now )
+            tw->cur = now;
+        return -1;
+    }
+    /* Buckets are only ever left behind when empty, so the current one
+     * holds the earliest timers, if any; these may still lie ahead of a
+     * clock that is behind the wheel, though. */
+    for ( ;; )
+    {
+        int i = tw->head[(unsigned)tw->cur & tw->mask];
+
+        while ( 0 <= i && tw->due[i] > now )
+            i = tw->next[i];
+        if ( 0 <= i )
+        {
+            twheel_del( tw, i );
+            return i;
+        }
+        if ( tw->cur >= now || 0 <= tw->head[(unsigned)tw->cur & tw->mask] )
+            break;
+        ++tw->cur;
+    }
+    return -1;
+}
+
+time_t twheel_next( const twheel_t *tw )
+{
+    unsigned n = tw->mask + 1;
+    unsigned b0 = (unsigned)tw->cur & tw->mask;
+
+    if ( 0 == tw->count )
+        return -1;
+    /* Scan the bitmap from the current bucket onwards, wrapping around. */
+    for ( unsigned k = 0; k < n; )
+    {
+        unsigned b = ( b0 + k ) & tw->mask;
+        uint64_t w = tw->bits[b / 64] >> ( b % 64 );
+        if ( 0 != w )
+        {
+            unsigned d = 0;
+            while ( !( w & 1 ) )
+                w >>= 1, ++d;
+            return tw->cur + k + d;
+        }
+        k += 64 - b % 64;
+    }
+    return -1;
+}
+
+
+/* EOF */
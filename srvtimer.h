@@ -0,0 +1,66 @@
+/*
+ * srvtimer.h
+ *
+ * Copyright 2016 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ */
+
+
+#ifndef SRVTIMER_H_INCLUDED
+#define SRVTIMER_H_INCLUDED
+
+#include <time.h>
+
+
+/* Timer wheel with one second resolution, holding at most one timer
+ * for each of a fixed number of entries, identified by index. Timers
+ * must not be set further ahead than the span given on creation. */
+typedef
+    struct TWHEEL_T_STRUCT
+    twheel_t;
+
+
+extern twheel_t *twheel_new( int nent, int span, time_t now );
+extern void twheel_free( twheel_t **ptw );
+
+extern int twheel_set( twheel_t *tw, int id, time_t due );
+extern int twheel_del( twheel_t *tw, int id );
+extern time_t twheel_due( const twheel_t *tw, int id );
+
+/* Remove and return one timer due at or before now, or -1 if none. */
+extern int twheel_pop( twheel_t *tw, time_t now );
+
+/* Time of the earliest pending timer, or -1 if there is none. */
+extern time_t twheel_next( const twheel_t *tw );
+
+
+#endif /* ndef _H_INCLUDED */
+
+/* EOF */
@@ -0,0 +1,121 @@
+/*
+ * srvzcopy.c
+ *
+ * Copyright 2016 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+    #define _DEFAULT_SOURCE     /* MSG_ZEROCOPY */
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+    #include <linux/errqueue.h>
+    #if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+        #define HAVE_ZEROCOPY
+    #endif
+#endif
+
+#include "srvzcopy.h"
+
+
+int zcopy_enable( int fd )
+{
+#ifdef HAVE_ZEROCOPY
+    int set = 1;
+
+    return setsockopt( fd, SOL_SOCKET, SO_ZEROCOPY, &set, sizeof set );
+#else
+    return errno = ENOSYS, -1;
+    (void)fd;
+#endif
+}
+
+ssize_t zcopy_sendv( int fd, const struct iovec *iov, int iovcnt )
+{
+#ifdef HAVE_ZEROCOPY
+    struct msghdr mh;
+
+    memset( &mh, 0, sizeof mh );
+    mh.msg_iov = (struct iovec *)iov;
+    mh.msg_iovlen = iovcnt;
+    return sendmsg( fd, &mh, MSG_ZEROCOPY );
+#else
+    return errno = ENOSYS, -1;
+    (void)fd; (void)iov; (void)iovcnt;
+#endif
+}
+
+int zcopy_reap( int fd, uint32_t *done, int *copied )
+{
+#ifdef HAVE_ZEROCOPY
+    char ctl[CMSG_SPACE( sizeof (struct sock_extended_err) ) * 2];
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    int n = 0;
+
+    for ( ;; )
+    {
+        memset( &mh, 0, sizeof mh );
+        mh.msg_control = ctl;
+        mh.msg_controllen = sizeof ctl;
+        if ( 0 > recvmsg( fd, &mh, MSG_ERRQUEUE ) )
+            return EAGAIN == errno || EWOULDBLOCK == errno ? n : -1;
+        for ( cm = CMSG_FIRSTHDR( &mh ); NULL != cm; cm = CMSG_NXTHDR( &mh, cm ) )
+        {
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA( cm );
+
+            if ( !( ( SOL_IP == cm->cmsg_level && IP_RECVERR == cm->cmsg_type )
+                    || ( SOL_IPV6 == cm->cmsg_level && IPV6_RECVERR == cm->cmsg_type ) )
+                || 0 != ee->ee_errno || SO_EE_ORIGIN_ZEROCOPY != ee->ee_origin )
+                continue;
+            /* Sends ee_info up to ee_data are complete. */
+            if ( 0 < (int32_t)( ee->ee_data + 1 - *done ) )
+                *done = ee->ee_data + 1;
+            if ( ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+                *copied = 1;
+            ++n;
+        }
+    }
+#else
+    return errno = ENOSYS, -1;
+    (void)fd; (void)done; (void)copied;
+#endif
+}
+
+/* EOF */
@@ -0,0 +1,60 @@
+/*
+ * srvzcopy.h
+ *
+ * Copyright 2016 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer
+ *   in the documentation and/or other materials provided with the
+ *   distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ */
+
+#ifndef SRVZCOPY_H_INCLUDED
+#define SRVZCOPY_H_INCLUDED
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+/* Zero-copy socket sends: the kernel transmits straight from the
+ * caller's buffers, which must stay untouched until it reports the send
+ * complete. Every send returning > 0 is assigned the next number of a
+ * per-socket sequence starting at 0. Only available on Linux; elsewhere
+ * zcopy_enable() fails with ENOSYS. */
+extern int zcopy_enable( int fd );
+extern ssize_t zcopy_sendv( int fd, const struct iovec *iov, int iovcnt );
+
+/* Collect completion reports for socket fd, advancing *done past the
+ * highest sequence number completed, and setting *copied if the kernel
+ * had to fall back to copying. Returns the number of reports collected,
+ * or -1 with errno set. */
+extern int zcopy_reap( int fd, uint32_t *done, int *copied );
+
+
+#endif /* ndef _H_INCLUDED */
+
+/* EOF */
@@ -0,0 +1 @@
+#define VERSION     "0.0.1.git0343b91-rls"